@@ -0,0 +1,590 @@
+/*
+ *                .__  _____.__                .__
+ *   ____________ |__|/ ____\  | _____    _____|  |__
+ *  /  ___/\____ \|  \   __\|  | \__  \  /  ___/  |  \
+ *  \___ \ |  |_> >  ||  |  |  |__/ __ \_\___ \|   Y  \
+ * /____  >|   __/|__||__|  |____(____  /____  >___|  /
+ *      \/ |__|                       \/     \/     \/
+ *
+ * SPI Flash reader.
+ *
+ * Very fast reader for SPI flashes for Teensy 2.x.
+ *
+ * Original code by Trammell Hudson (https://trmm.net/SPI)
+ * Modifications and addons by Pedro Vilaça - https://reverse.put.as - reverser@put.as
+ *
+ * Copyright (C) 2012 Trammell Hudson
+ * Copyright (C) 2015, 2016, 2017 Pedro Vilaça
+ *
+ * Hardware pinout reference: https://papers.put.as/papers/macosx/2015/44Con_2015_-_Efi_Monsters.pdf
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * chips.c
+ *
+ * Database of known SPI flash chips, keyed by JEDEC ID
+ *
+ * Typical and maximum times are taken from the datasheets.
+ *
+ */
+
+#include <avr/pgmspace.h>
+#include <stdint.h>
+#include <string.h>
+#include "chips.h"
+
+static const chip_t chip_db[] PROGMEM = {
+	{
+		.id = { 0x20, 0xBA, 0x16 },
+		.size_shift = 22,
+		.sector_shift = 12,
+		.page_shift = 8,
+		.flags = CHIP_ERASE_4K | CHIP_ERASE_64K | CHIP_FSR | CHIP_QUAD | CHIP_SOFT_RESET,
+		.chip_erase_op = 0xC7,
+		.suspend_op = 0x75, .resume_op = 0x7A,
+		.tpp_typ = 500, .tpp_max = 5000,
+		.tse_typ = 250, .tse_max = 800,
+		.tbe32_typ = 0, .tbe64_typ = 700, .tbe_max = 3000,
+		.tce_typ = 15000, .tce_max = 60000,
+		.name = "N25Q032A",
+	},
+	{
+		.id = { 0x20, 0xBA, 0x17 },
+		.size_shift = 23,
+		.sector_shift = 12,
+		.page_shift = 8,
+		.flags = CHIP_ERASE_4K | CHIP_ERASE_64K | CHIP_FSR | CHIP_QUAD | CHIP_SOFT_RESET,
+		.chip_erase_op = 0xC7,
+		.suspend_op = 0x75, .resume_op = 0x7A,
+		.tpp_typ = 500, .tpp_max = 5000,
+		.tse_typ = 250, .tse_max = 800,
+		.tbe32_typ = 0, .tbe64_typ = 700, .tbe_max = 3000,
+		.tce_typ = 30000, .tce_max = 120000,
+		.name = "N25Q064A",
+	},
+	{
+		.id = { 0x20, 0xBA, 0x18 },
+		.size_shift = 24,
+		.sector_shift = 12,
+		.page_shift = 8,
+		.flags = CHIP_ERASE_4K | CHIP_ERASE_64K | CHIP_FSR | CHIP_QUAD | CHIP_SOFT_RESET,
+		.chip_erase_op = 0xC7,
+		.suspend_op = 0x75, .resume_op = 0x7A,
+		.tpp_typ = 500, .tpp_max = 5000,
+		.tse_typ = 250, .tse_max = 800,
+		.tbe32_typ = 0, .tbe64_typ = 700, .tbe_max = 3000,
+		.tce_typ = 60000, .tce_max = 250000,
+		.name = "N25Q128A",
+	},
+	{
+		.id = { 0xEF, 0x40, 0x16 },
+		.size_shift = 22,
+		.sector_shift = 12,
+		.page_shift = 8,
+		.flags = CHIP_ERASE_4K | CHIP_ERASE_32K | CHIP_ERASE_64K | CHIP_QE_SR2_BIT1 | CHIP_SOFT_RESET,
+		.chip_erase_op = 0xC7,
+		.suspend_op = 0x75, .resume_op = 0x7A,
+		.tpp_typ = 700, .tpp_max = 3000,
+		.tse_typ = 45, .tse_max = 400,
+		.tbe32_typ = 120, .tbe64_typ = 150, .tbe_max = 2000,
+		.tce_typ = 10000, .tce_max = 50000,
+		.name = "W25Q32FV",
+	},
+	{
+		.id = { 0xEF, 0x40, 0x17 },
+		.size_shift = 23,
+		.sector_shift = 12,
+		.page_shift = 8,
+		.flags = CHIP_ERASE_4K | CHIP_ERASE_32K | CHIP_ERASE_64K | CHIP_QE_SR2_BIT1 | CHIP_SOFT_RESET,
+		.chip_erase_op = 0xC7,
+		.suspend_op = 0x75, .resume_op = 0x7A,
+		.tpp_typ = 700, .tpp_max = 3000,
+		.tse_typ = 45, .tse_max = 400,
+		.tbe32_typ = 120, .tbe64_typ = 150, .tbe_max = 2000,
+		.tce_typ = 20000, .tce_max = 100000,
+		.name = "W25Q64FV",
+	},
+	{
+		.id = { 0xEF, 0x40, 0x18 },
+		.size_shift = 24,
+		.sector_shift = 12,
+		.page_shift = 8,
+		.flags = CHIP_ERASE_4K | CHIP_ERASE_32K | CHIP_ERASE_64K | CHIP_QE_SR2_BIT1 | CHIP_SOFT_RESET,
+		.chip_erase_op = 0xC7,
+		.suspend_op = 0x75, .resume_op = 0x7A,
+		.tpp_typ = 700, .tpp_max = 3000,
+		.tse_typ = 45, .tse_max = 400,
+		.tbe32_typ = 120, .tbe64_typ = 150, .tbe_max = 2000,
+		.tce_typ = 40000, .tce_max = 200000,
+		.name = "W25Q128FV",
+	},
+	{
+		.id = { 0xEF, 0x40, 0x19 },
+		.size_shift = 25,
+		.sector_shift = 12,
+		.page_shift = 8,
+		.flags = CHIP_ERASE_4K | CHIP_ERASE_32K | CHIP_ERASE_64K | CHIP_QE_SR2_BIT1 | CHIP_4B_OPCODES | CHIP_SOFT_RESET,
+		.chip_erase_op = 0xC7,
+		.suspend_op = 0x75, .resume_op = 0x7A,
+		.tpp_typ = 700, .tpp_max = 3000,
+		.tse_typ = 45, .tse_max = 400,
+		.tbe32_typ = 120, .tbe64_typ = 150, .tbe_max = 2000,
+		.tce_typ = 80000, .tce_max = 400000,
+		.name = "W25Q256FV",
+	},
+	{
+		.id = { 0xC2, 0x20, 0x14 },
+		.size_shift = 20,
+		.sector_shift = 12,
+		.page_shift = 8,
+		.flags = CHIP_ERASE_4K | CHIP_ERASE_64K,
+		.chip_erase_op = 0xC7,
+		.tpp_typ = 1400, .tpp_max = 5000,
+		.tse_typ = 60, .tse_max = 300,
+		.tbe32_typ = 0, .tbe64_typ = 700, .tbe_max = 2000,
+		.tce_typ = 7000, .tce_max = 15000,
+		.name = "MX25L8006E",
+	},
+	{
+		.id = { 0xC2, 0x20, 0x15 },
+		.size_shift = 21,
+		.sector_shift = 12,
+		.page_shift = 8,
+		.flags = CHIP_ERASE_4K | CHIP_ERASE_32K | CHIP_ERASE_64K | CHIP_QE_SR1_BIT6,
+		.chip_erase_op = 0xC7,
+		.tpp_typ = 1400, .tpp_max = 5000,
+		.tse_typ = 60, .tse_max = 300,
+		.tbe32_typ = 500, .tbe64_typ = 700, .tbe_max = 2000,
+		.tce_typ = 14000, .tce_max = 30000,
+		.name = "MX25L1606E",
+	},
+	/* MX25L64 chip erase is not used, 64k blocks are erased instead */
+	{
+		.id = { 0xC2, 0x20, 0x17 },
+		.size_shift = 23,
+		.sector_shift = 12,
+		.page_shift = 8,
+		.flags = CHIP_ERASE_4K | CHIP_ERASE_64K,
+		.chip_erase_op = 0,
+		.tpp_typ = 1400, .tpp_max = 5000,
+		.tse_typ = 60, .tse_max = 300,
+		.tbe32_typ = 0, .tbe64_typ = 700, .tbe_max = 2000,
+		.tce_typ = 0, .tce_max = 0,
+		.name = "MX25L6406E",
+	},
+	{
+		.id = { 0xC2, 0x20, 0x18 },
+		.size_shift = 24,
+		.sector_shift = 12,
+		.page_shift = 8,
+		.flags = CHIP_ERASE_4K | CHIP_ERASE_32K | CHIP_ERASE_64K | CHIP_QE_SR1_BIT6 | CHIP_SOFT_RESET,
+		.chip_erase_op = 0xC7,
+		.suspend_op = 0xB0, .resume_op = 0x30,
+		.tpp_typ = 330, .tpp_max = 1200,
+		.tse_typ = 40, .tse_max = 200,
+		.tbe32_typ = 200, .tbe64_typ = 400, .tbe_max = 2000,
+		.tce_typ = 80000, .tce_max = 200000,
+		.name = "MX25L12835F",
+	},
+	{
+		.id = { 0xC2, 0x20, 0x19 },
+		.size_shift = 25,
+		.sector_shift = 12,
+		.page_shift = 8,
+		.flags = CHIP_ERASE_4K | CHIP_ERASE_32K | CHIP_ERASE_64K | CHIP_QE_SR1_BIT6 | CHIP_4B_OPCODES | CHIP_SOFT_RESET,
+		.chip_erase_op = 0xC7,
+		.suspend_op = 0xB0, .resume_op = 0x30,
+		.tpp_typ = 330, .tpp_max = 1200,
+		.tse_typ = 40, .tse_max = 200,
+		.tbe32_typ = 200, .tbe64_typ = 400, .tbe_max = 2000,
+		.tce_typ = 150000, .tce_max = 400000,
+		.name = "MX25L25635F",
+	},
+	{
+		.id = { 0x01, 0x20, 0x18 },
+		.size_shift = 24,
+		.sector_shift = 16,
+		.page_shift = 8,
+		.flags = CHIP_ERASE_64K | CHIP_QE_SR2_BIT1,
+		.chip_erase_op = 0x60,
+		.suspend_op = 0x75, .resume_op = 0x7A,
+		.tpp_typ = 250, .tpp_max = 750,
+		.tse_typ = 0, .tse_max = 0,
+		.tbe32_typ = 0, .tbe64_typ = 130, .tbe_max = 650,
+		.tce_typ = 33000, .tce_max = 165000,
+		.name = "S25FL128S/P",
+	},
+	{
+		.id = { 0x01, 0x02, 0x19 },
+		.size_shift = 25,
+		.sector_shift = 16,
+		.page_shift = 8,
+		.flags = CHIP_ERASE_64K | CHIP_QE_SR2_BIT1 | CHIP_4B_OPCODES,
+		.chip_erase_op = 0x60,
+		.suspend_op = 0x75, .resume_op = 0x7A,
+		.tpp_typ = 250, .tpp_max = 750,
+		.tse_typ = 0, .tse_max = 0,
+		.tbe32_typ = 0, .tbe64_typ = 130, .tbe_max = 650,
+		.tce_typ = 66000, .tce_max = 330000,
+		.name = "S25FL256S/P",
+	},
+	{
+		.id = { 0x1C, 0x20, 0x15 },
+		.size_shift = 21,
+		.sector_shift = 16,
+		.page_shift = 8,
+		.flags = CHIP_ERASE_64K,
+		.chip_erase_op = 0xC7,
+		.tpp_typ = 1500, .tpp_max = 5000,
+		.tse_typ = 0, .tse_max = 0,
+		.tbe32_typ = 0, .tbe64_typ = 800, .tbe_max = 2000,
+		.tce_typ = 17000, .tce_max = 40000,
+		.name = "EN25P16",
+	},
+	/* SST25VF have no page program, times are per word */
+	{
+		.id = { 0xBF, 0x25, 0x8D },
+		.size_shift = 19,
+		.sector_shift = 12,
+		.page_shift = 0,
+		.flags = CHIP_ERASE_4K | CHIP_ERASE_32K | CHIP_ERASE_64K | CHIP_SST_AAI,
+		.chip_erase_op = 0x60,
+		.tpp_typ = 10, .tpp_max = 10,
+		.tse_typ = 18, .tse_max = 25,
+		.tbe32_typ = 18, .tbe64_typ = 18, .tbe_max = 25,
+		.tce_typ = 35, .tce_max = 50,
+		.name = "SST25VF040B",
+	},
+	{
+		.id = { 0xBF, 0x25, 0x8E },
+		.size_shift = 20,
+		.sector_shift = 12,
+		.page_shift = 0,
+		.flags = CHIP_ERASE_4K | CHIP_ERASE_32K | CHIP_ERASE_64K | CHIP_SST_AAI,
+		.chip_erase_op = 0x60,
+		.tpp_typ = 10, .tpp_max = 10,
+		.tse_typ = 18, .tse_max = 25,
+		.tbe32_typ = 18, .tbe64_typ = 18, .tbe_max = 25,
+		.tce_typ = 35, .tce_max = 50,
+		.name = "SST25VF080B",
+	},
+	{
+		.id = { 0xBF, 0x25, 0x41 },
+		.size_shift = 21,
+		.sector_shift = 12,
+		.page_shift = 0,
+		.flags = CHIP_ERASE_4K | CHIP_ERASE_32K | CHIP_ERASE_64K | CHIP_SST_AAI,
+		.chip_erase_op = 0x60,
+		.tpp_typ = 10, .tpp_max = 10,
+		.tse_typ = 18, .tse_max = 25,
+		.tbe32_typ = 18, .tbe64_typ = 18, .tbe_max = 25,
+		.tce_typ = 35, .tce_max = 50,
+		.name = "SST25VF016B",
+	},
+	{
+		.id = { 0xBF, 0x25, 0x4A },
+		.size_shift = 22,
+		.sector_shift = 12,
+		.page_shift = 0,
+		.flags = CHIP_ERASE_4K | CHIP_ERASE_32K | CHIP_ERASE_64K | CHIP_SST_AAI,
+		.chip_erase_op = 0x60,
+		.tpp_typ = 10, .tpp_max = 10,
+		.tse_typ = 18, .tse_max = 25,
+		.tbe32_typ = 18, .tbe64_typ = 18, .tbe_max = 25,
+		.tce_typ = 35, .tce_max = 50,
+		.name = "SST25VF032B",
+	},
+	/* 0xD8 erases 32k blocks on the 512 Kbit part, stick to 4k */
+	{
+		.id = { 0x7F, 0x9D, 0x20 },
+		.size_shift = 16,
+		.sector_shift = 12,
+		.page_shift = 8,
+		.flags = CHIP_ERASE_4K,
+		.chip_erase_op = 0xC7,
+		.tpp_typ = 1000, .tpp_max = 5000,
+		.tse_typ = 40, .tse_max = 100,
+		.tbe32_typ = 0, .tbe64_typ = 0, .tbe_max = 100,
+		.tce_typ = 40, .tce_max = 100,
+		.name = "Pm25LD512",
+	},
+	{
+		.id = { 0x7F, 0x9D, 0x21 },
+		.size_shift = 17,
+		.sector_shift = 12,
+		.page_shift = 8,
+		.flags = CHIP_ERASE_4K | CHIP_ERASE_64K,
+		.chip_erase_op = 0xC7,
+		.tpp_typ = 1000, .tpp_max = 5000,
+		.tse_typ = 40, .tse_max = 100,
+		.tbe32_typ = 0, .tbe64_typ = 80, .tbe_max = 200,
+		.tce_typ = 80, .tce_max = 200,
+		.name = "Pm25LD010",
+	},
+	{
+		.id = { 0x7F, 0x9D, 0x22 },
+		.size_shift = 18,
+		.sector_shift = 12,
+		.page_shift = 8,
+		.flags = CHIP_ERASE_4K | CHIP_ERASE_64K,
+		.chip_erase_op = 0xC7,
+		.tpp_typ = 1000, .tpp_max = 5000,
+		.tse_typ = 40, .tse_max = 100,
+		.tbe32_typ = 0, .tbe64_typ = 80, .tbe_max = 200,
+		.tce_typ = 160, .tce_max = 400,
+		.name = "Pm25LD020",
+	},
+};
+
+/* used for anything we don't know, same behaviour as before the database */
+static const chip_t chip_generic PROGMEM = {
+	.id = { 0x00, 0x00, 0x00 },
+	.size_shift = 23,
+	.sector_shift = 12,
+	.page_shift = 8,
+	.flags = CHIP_ERASE_4K | CHIP_ERASE_64K,
+	.chip_erase_op = 0,
+	.tpp_typ = 700, .tpp_max = 5000,
+	.tse_typ = 60, .tse_max = 800,
+	.tbe32_typ = 0, .tbe64_typ = 700, .tbe_max = 3000,
+	.tce_typ = 0, .tce_max = 0,
+	.name = "unknown chip",
+};
+
+
+uint8_t
+chip_db_count(void)
+{
+	return sizeof(chip_db) / sizeof(*chip_db);
+}
+
+
+uint8_t
+chip_lookup(
+	chip_t * const chip,
+	const uint8_t id0,
+	const uint8_t id1,
+	const uint8_t id2
+)
+{
+	for (uint8_t i = 0 ; i < sizeof(chip_db) / sizeof(*chip_db) ; i++)
+	{
+		const chip_t * const entry = &chip_db[i];
+		if (pgm_read_byte(&entry->id[0]) != id0
+		||  pgm_read_byte(&entry->id[1]) != id1
+		||  pgm_read_byte(&entry->id[2]) != id2)
+			continue;
+
+		memcpy_P(chip, entry, sizeof(*chip));
+		return 1;
+	}
+
+	memcpy_P(chip, &chip_generic, sizeof(*chip));
+	chip->id[0] = id0;
+	chip->id[1] = id1;
+	chip->id[2] = id2;
+	return 0;
+}
+
+
+static uint32_t
+sfdp_dword(
+	const uint8_t * const bfpt,
+	const uint8_t n
+)
+{
+	/* dwords are numbered from 1 in the standard */
+	const uint8_t * const p = &bfpt[(n - 1) * 4];
+	return (uint32_t) p[0] << 0
+	     | (uint32_t) p[1] << 8
+	     | (uint32_t) p[2] << 16
+	     | (uint32_t) p[3] << 24;
+}
+
+
+/* erase time field: 5 bit count and 2 bit unit of 1ms, 16ms, 128ms, 1s */
+static uint16_t
+sfdp_erase_ms(
+	const uint8_t field
+)
+{
+	static const uint16_t units[] = { 1, 16, 128, 1000 };
+	return ((field & 0x1F) + 1) * units[(field >> 5) & 3];
+}
+
+
+/* typical time times the max multiplier, done in 32 bits since a
+ * long erase times 32 doesn't fit an AVR int, and clamped
+ */
+static uint16_t
+sfdp_max_time(
+	const uint16_t typ,
+	const uint8_t mult
+)
+{
+	const uint32_t t = (uint32_t) typ * mult;
+	return t > UINT16_MAX ? UINT16_MAX : t;
+}
+
+
+uint8_t
+chip_sfdp_parse(
+	chip_t * const chip,
+	const uint8_t * const bfpt,
+	const uint8_t dwords,
+	const uint8_t has_4bait
+)
+{
+	/* JESD216 rev 0 has 9 dwords, anything shorter is broken */
+	if (dwords < 9)
+		return 0;
+
+	const uint32_t dw1 = sfdp_dword(bfpt, 1);
+	const uint32_t dw2 = sfdp_dword(bfpt, 2);
+
+	/* density is in bits, either N-1 or 2^N */
+	uint8_t size_shift;
+	if (dw2 & 0x80000000)
+	{
+		size_shift = (dw2 & 0x7FFFFFFF) - 3;
+	} else {
+		uint32_t bytes = (dw2 >> 3) + 1;
+		size_shift = 0;
+		while (bytes > 1)
+		{
+			bytes >>= 1;
+			size_shift++;
+		}
+	}
+	if (size_shift < 12 || size_shift > 31)
+		return 0;
+
+	chip->size_shift = size_shift;
+	chip->sector_shift = 0;
+	chip->flags = 0;
+	chip->suspend_op = 0;
+
+	/* erase type timings are only in JESD216A and later */
+	const uint32_t dw10 = dwords >= 10 ? sfdp_dword(bfpt, 10) : 0;
+	const uint8_t erase_mult = 2 * ((dw10 & 0x0F) + 1);
+	uint16_t tbe_max = 0;
+
+	/* up to four erase types, only the standard opcodes are used */
+	for (uint8_t i = 0 ; i < 4 ; i++)
+	{
+		const uint32_t dw = sfdp_dword(bfpt, 8 + i / 2);
+		const uint8_t shift = dw >> (16 * (i & 1));
+		const uint8_t op = dw >> (16 * (i & 1) + 8);
+		const uint16_t typ = dw10
+			? sfdp_erase_ms(dw10 >> (4 + 7 * i))
+			: 0;
+
+		if (shift == 12 && op == 0x20)
+		{
+			chip->flags |= CHIP_ERASE_4K;
+			chip->tse_typ = typ;
+			chip->tse_max = sfdp_max_time(typ, erase_mult);
+		} else
+		if (shift == 15 && op == 0x52)
+		{
+			chip->flags |= CHIP_ERASE_32K;
+			chip->tbe32_typ = typ;
+		} else
+		if (shift == 16 && op == 0xD8)
+		{
+			chip->flags |= CHIP_ERASE_64K;
+			chip->tbe64_typ = typ;
+		} else
+			continue;
+
+		if (sfdp_max_time(typ, erase_mult) > tbe_max)
+			tbe_max = sfdp_max_time(typ, erase_mult);
+		if (chip->sector_shift == 0 || shift < chip->sector_shift)
+			chip->sector_shift = shift;
+	}
+
+	/* older tables only have the 4k opcode in dword 1 */
+	if (chip->sector_shift == 0 && (dw1 & 3) == 1 && ((dw1 >> 8) & 0xFF) == 0x20)
+	{
+		chip->flags |= CHIP_ERASE_4K;
+		chip->sector_shift = 12;
+	}
+	if (tbe_max)
+		chip->tbe_max = tbe_max;
+
+	/* page size, program and chip erase times */
+	chip->page_shift = 8;
+	chip->chip_erase_op = 0xC7;
+	if (dwords >= 11)
+	{
+		static const uint32_t ce_units[] = { 16, 256, 4000, 64000 };
+		const uint32_t dw11 = sfdp_dword(bfpt, 11);
+		const uint8_t pp_mult = 2 * ((dw11 & 0x0F) + 1);
+
+		chip->page_shift = (dw11 >> 4) & 0x0F;
+		chip->tpp_typ = (((dw11 >> 8) & 0x1F) + 1)
+			* ((dw11 & (1UL << 13)) ? 64 : 8);
+		chip->tpp_max = sfdp_max_time(chip->tpp_typ, pp_mult);
+		chip->tce_typ = (((dw11 >> 24) & 0x1F) + 1)
+			* ce_units[(dw11 >> 29) & 3];
+		chip->tce_max = chip->tce_typ * erase_mult;
+	}
+
+	/* erase suspend and resume, dword 12 bit 31 set means unsupported */
+	if (dwords >= 13 && !(sfdp_dword(bfpt, 12) & (1UL << 31)))
+	{
+		const uint32_t dw13 = sfdp_dword(bfpt, 13);
+		chip->suspend_op = dw13 >> 24;
+		chip->resume_op = dw13 >> 16;
+	}
+
+	/* flag status register polling */
+	if (dwords >= 14 && (sfdp_dword(bfpt, 14) & (1 << 3)))
+		chip->flags |= CHIP_FSR;
+
+	/* 1-1-4 fast read and how its quad enable bit is set; JESD216
+	 * rev 0 tables stop before dword 15, the QE method is unknown
+	 * then so quad reads stay off
+	 */
+	if ((dw1 & (1UL << 22)) && dwords >= 15)
+	{
+		const uint8_t qer = (sfdp_dword(bfpt, 15) >> 20) & 7;
+		switch (qer)
+		{
+		case 0: chip->flags |= CHIP_QUAD; break;
+		case 2: chip->flags |= CHIP_QE_SR1_BIT6; break;
+		case 1:
+		case 4:
+		case 5: chip->flags |= CHIP_QE_SR2_BIT1; break;
+		default: break;
+		}
+	}
+
+	/* addressing above 16MB */
+	if (has_4bait)
+		chip->flags |= CHIP_4B_OPCODES;
+	else
+	if (dwords >= 16 && (sfdp_dword(bfpt, 16) & (3UL << 24)))
+		chip->flags |= CHIP_4B_MODE;
+	else
+	if (((dw1 >> 17) & 3) != 0)
+		chip->flags |= CHIP_4B_MODE;
+
+	/* soft reset and rescue sequences, x1_xxxx is 0x66 + 0x99 */
+	if (dwords >= 16 && (sfdp_dword(bfpt, 16) & (1UL << 12)))
+		chip->flags |= CHIP_SOFT_RESET;
+
+	memcpy_P(chip->name, PSTR("SFDP"), sizeof("SFDP"));
+	return 1;
+}
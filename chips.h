@@ -0,0 +1,135 @@
+/*
+ *                .__  _____.__                .__
+ *   ____________ |__|/ ____\  | _____    _____|  |__
+ *  /  ___/\____ \|  \   __\|  | \__  \  /  ___/  |  \
+ *  \___ \ |  |_> >  ||  |  |  |__/ __ \_\___ \|   Y  \
+ * /____  >|   __/|__||__|  |____(____  /____  >___|  /
+ *      \/ |__|                       \/     \/     \/
+ *
+ * SPI Flash reader.
+ *
+ * Very fast reader for SPI flashes for Teensy 2.x.
+ *
+ * Original code by Trammell Hudson (https://trmm.net/SPI)
+ * Modifications and addons by Pedro Vilaça - https://reverse.put.as - reverser@put.as
+ *
+ * Copyright (C) 2012 Trammell Hudson
+ * Copyright (C) 2015, 2016, 2017 Pedro Vilaça
+ *
+ * Hardware pinout reference: https://papers.put.as/papers/macosx/2015/44Con_2015_-_Efi_Monsters.pdf
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * chips.h
+ *
+ * Database of known SPI flash chips, keyed by JEDEC ID
+ *
+ */
+
+#ifndef _chips_h_
+#define _chips_h_
+
+#include <avr/pgmspace.h>
+#include <stdint.h>
+
+/* supported erase commands */
+#define CHIP_ERASE_4K		0x0001	// 0x20
+#define CHIP_ERASE_32K		0x0002	// 0x52
+#define CHIP_ERASE_64K		0x0004	// 0xD8
+/* addressing above 16MB */
+#define CHIP_4B_OPCODES		0x0008	// 0x13/0x12/0x21/0xDC...
+#define CHIP_4B_MODE		0x0010	// 0xB7
+/* completion is signalled by the flag status register */
+#define CHIP_FSR		0x0020
+/* how quad output read is enabled */
+#define CHIP_QUAD		0x0040	// always available
+#define CHIP_QE_SR1_BIT6	0x0080	// status register bit 6 (Macronix)
+#define CHIP_QE_SR2_BIT1	0x0100	// second register bit 1 (Winbond SR2, Spansion CR)
+/* no page program, word program with auto address increment (0xAD) */
+#define CHIP_SST_AAI		0x0200
+/* software reset, reset enable then reset */
+#define CHIP_SOFT_RESET		0x0400	// 0x66 + 0x99
+
+#define CHIP_NAME_LEN		16
+
+/* bumped whenever entries are added or corrected */
+#define CHIP_DB_VERSION		2
+
+typedef struct
+{
+	uint8_t id[3];		// JEDEC manufacturer, memory type, capacity
+	uint8_t size_shift;	// capacity is 1 << size_shift bytes
+	uint8_t sector_shift;	// smallest erase unit
+	uint8_t page_shift;	// page program size, 0 if it has none
+	uint16_t flags;
+	uint8_t chip_erase_op;	// 0 if it has none
+	uint8_t suspend_op;	// erase suspend, 0 if it has none
+	uint8_t resume_op;	// erase resume
+	/* the *_typ times drive the erase planner and ETAs, the benchmark
+	 * (M) replaces them with measured averages; the *_max times stay
+	 * the datasheet ones, they bound every wait for the busy bit
+	 */
+	uint16_t tpp_typ;	// page program, us
+	uint16_t tpp_max;
+	uint16_t tse_typ;	// 4k sector erase, ms
+	uint16_t tse_max;
+	uint16_t tbe32_typ;	// 32k block erase, ms
+	uint16_t tbe64_typ;	// 64k block erase, ms
+	uint16_t tbe_max;	// any block erase, ms
+	uint32_t tce_typ;	// chip erase, ms
+	uint32_t tce_max;
+	char name[CHIP_NAME_LEN];
+} chip_t;
+
+
+/** Copy the entry for a JEDEC ID into chip.
+ *
+ * \return 1 if found, 0 if unknown (chip is then set to generic defaults)
+ */
+uint8_t
+chip_lookup(
+	chip_t * const chip,
+	const uint8_t id0,
+	const uint8_t id1,
+	const uint8_t id2
+);
+
+
+/* SFDP (JESD216) header and parameter header sizes */
+#define SFDP_SIGNATURE		0x50444653	// "SFDP", little endian
+#define SFDP_HEADER_LEN		8
+#define SFDP_PARAM_LEN		8
+#define SFDP_BFPT_MAX_DWORDS	16
+
+/** Number of entries in the database. */
+uint8_t
+chip_db_count(void);
+
+/** Fill chip from a JESD216 Basic Flash Parameter Table.
+ *
+ * bfpt holds dwords little endian dwords as read from the chip.
+ * has_4bait is set when the 4-byte address instruction table is present.
+ *
+ * \return 1 if the table was usable, 0 otherwise (chip is left untouched)
+ */
+uint8_t
+chip_sfdp_parse(
+	chip_t * const chip,
+	const uint8_t * const bfpt,
+	const uint8_t dwords,
+	const uint8_t has_4bait
+);
+
+
+#endif
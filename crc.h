@@ -0,0 +1,80 @@
+/*
+ *                .__  _____.__                .__
+ *   ____________ |__|/ ____\  | _____    _____|  |__
+ *  /  ___/\____ \|  \   __\|  | \__  \  /  ___/  |  \
+ *  \___ \ |  |_> >  ||  |  |  |__/ __ \_\___ \|   Y  \
+ * /____  >|   __/|__||__|  |____(____  /____  >___|  /
+ *      \/ |__|                       \/     \/     \/
+ *
+ * SPI Flash reader.
+ *
+ * Very fast reader for SPI flashes for Teensy 2.x.
+ *
+ * Original code by Trammell Hudson (https://trmm.net/SPI)
+ * Modifications and addons by Pedro Vilaça - https://reverse.put.as - reverser@put.as
+ *
+ * Copyright (C) 2012 Trammell Hudson
+ * Copyright (C) 2015, 2016, 2017 Pedro Vilaça
+ *
+ * Hardware pinout reference: https://papers.put.as/papers/macosx/2015/44Con_2015_-_Efi_Monsters.pdf
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * crc.h
+ *
+ * CRC-16/XMODEM and CRC-32 byte update functions
+ *
+ * Both are cheap enough to run on one byte while the
+ * next one is being shifted in by the SPI hardware.
+ *
+ */
+
+#ifndef _crc_h_
+#define _crc_h_
+
+#include <avr/pgmspace.h>
+#include <stdint.h>
+
+#define CRC16_INIT	0x0000
+#define CRC32_INIT	0xFFFFFFFFUL
+#define CRC32_FINAL(crc) (~(crc))
+
+extern const uint32_t crc32_table[256] PROGMEM;
+
+
+/** CRC-16/XMODEM, polynomial 0x1021, no table needed */
+static inline uint16_t
+crc16_update(
+	uint16_t crc,
+	const uint8_t b
+)
+{
+	uint8_t x = (crc >> 8) ^ b;
+	x ^= x >> 4;
+	return (crc << 8) ^ ((uint16_t) x << 12) ^ ((uint16_t) x << 5) ^ x;
+}
+
+
+/** CRC-32 (IEEE 802.3, reflected 0xEDB88320) */
+static inline uint32_t
+crc32_update(
+	uint32_t crc,
+	const uint8_t b
+)
+{
+	return (crc >> 8) ^ pgm_read_dword(&crc32_table[(uint8_t) crc ^ b]);
+}
+
+
+#endif
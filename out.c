@@ -0,0 +1,187 @@
+/*
+ *                .__  _____.__                .__
+ *   ____________ |__|/ ____\  | _____    _____|  |__
+ *  /  ___/\____ \|  \   __\|  | \__  \  /  ___/  |  \
+ *  \___ \ |  |_> >  ||  |  |  |__/ __ \_\___ \|   Y  \
+ * /____  >|   __/|__||__|  |____(____  /____  >___|  /
+ *      \/ |__|                       \/     \/     \/
+ *
+ * SPI Flash reader.
+ *
+ * Very fast reader for SPI flashes for Teensy 2.x.
+ *
+ * Original code by Trammell Hudson (https://trmm.net/SPI)
+ * Modifications and addons by Pedro Vilaça - https://reverse.put.as - reverser@put.as
+ *
+ * Copyright (C) 2012 Trammell Hudson
+ * Copyright (C) 2015, 2016, 2017 Pedro Vilaça
+ *
+ * Hardware pinout reference: https://papers.put.as/papers/macosx/2015/44Con_2015_-_Efi_Monsters.pdf
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ * out.c
+ *
+ * Buffered console output
+ *
+ * Output is collected into whole 64 byte packets before it is handed
+ * to usb_serial_write(), so a long text dump pays the endpoint setup
+ * once per packet instead of once per character or line.
+ *
+ */
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+#include "out.h"
+#include "usb_serial.h"
+
+const char out_hexdigits[16] PROGMEM = "0123456789ABCDEF";
+
+static uint8_t out_buf[OUT_SIZE];
+static uint8_t out_len;
+
+
+/* a write the host isn't reading drops the data, like putchar */
+static void
+out_send(void)
+{
+	usb_serial_write(out_buf, out_len);
+	out_len = 0;
+}
+
+
+static inline void
+out_put(
+	char c
+)
+{
+	out_buf[out_len++] = c;
+	if (out_len == OUT_SIZE)
+		out_send();
+}
+
+
+void
+out_char(
+	char c
+)
+{
+	out_put(c);
+}
+
+
+void
+out_write(
+	const void * buf,
+	uint16_t len
+)
+{
+	const uint8_t * p = buf;
+
+	while (len)
+	{
+		uint8_t n = OUT_SIZE - out_len;
+		if (n > len)
+			n = len;
+		for (uint8_t i = 0 ; i < n ; i++)
+			out_buf[out_len + i] = p[i];
+		out_len += n;
+		p += n;
+		len -= n;
+		if (out_len == OUT_SIZE)
+			out_send();
+	}
+}
+
+
+void
+out_str_P(
+	const char * s
+)
+{
+	while (1)
+	{
+		char c = pgm_read_byte(s++);
+		if (!c)
+			break;
+		out_put(c);
+	}
+}
+
+
+void
+out_hex(
+	uint32_t val,
+	uint8_t digits
+)
+{
+	while (digits--)
+		out_put(pgm_read_byte(&out_hexdigits[(val >> (4 * digits)) & 0xF]));
+}
+
+
+void
+out_hexdump(
+	const uint8_t * buf,
+	uint8_t len
+)
+{
+	for (uint8_t i = 0 ; i < len ; i++)
+	{
+		out_put(pgm_read_byte(&out_hexdigits[buf[i] >> 4]));
+		out_put(pgm_read_byte(&out_hexdigits[buf[i] & 0xF]));
+		out_put(' ');
+	}
+
+	out_put('\r');
+	out_put('\n');
+}
+
+
+void
+out_base85(
+	const uint8_t * buf,
+	uint8_t len
+)
+{
+	while (len)
+	{
+		const uint8_t n = len < 4 ? len : 4;
+		uint32_t word = 0;
+		for (uint8_t i = 0 ; i < 4 ; i++)
+			word = (word << 8) | (i < n ? buf[i] : 0);
+
+		char digits[5];
+		for (int8_t i = 4 ; i >= 0 ; i--)
+		{
+			digits[i] = '!' + word % 85;
+			word /= 85;
+		}
+
+		for (uint8_t i = 0 ; i <= n ; i++)
+			out_put(digits[i]);
+
+		buf += n;
+		len -= n;
+	}
+}
+
+
+void
+out_flush(void)
+{
+	if (!out_len)
+		return;
+	out_send();
+	usb_serial_flush_output();
+}
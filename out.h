@@ -0,0 +1,104 @@
+/*
+ *                .__  _____.__                .__
+ *   ____________ |__|/ ____\  | _____    _____|  |__
+ *  /  ___/\____ \|  \   __\|  | \__  \  /  ___/  |  \
+ *  \___ \ |  |_> >  ||  |  |  |__/ __ \_\___ \|   Y  \
+ * /____  >|   __/|__||__|  |____(____  /____  >___|  /
+ *      \/ |__|                       \/     \/     \/
+ *
+ * SPI Flash reader.
+ *
+ * Very fast reader for SPI flashes for Teensy 2.x.
+ *
+ * Original code by Trammell Hudson (https://trmm.net/SPI)
+ * Modifications and addons by Pedro Vilaça - https://reverse.put.as - reverser@put.as
+ *
+ * Copyright (C) 2012 Trammell Hudson
+ * Copyright (C) 2015, 2016, 2017 Pedro Vilaça
+ *
+ * Hardware pinout reference: https://papers.put.as/papers/macosx/2015/44Con_2015_-_Efi_Monsters.pdf
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ * out.h
+ *
+ * Buffered console output
+ *
+ */
+
+#ifndef _out_h_
+#define _out_h_
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+/** One full CDC packet. */
+#define OUT_SIZE	64
+
+/** Nibble to ASCII, upper case. */
+extern const char out_hexdigits[16] PROGMEM;
+
+/** Queue one character. */
+void
+out_char(
+	char c
+);
+
+/** Queue a buffer from RAM. */
+void
+out_write(
+	const void * buf,
+	uint16_t len
+);
+
+/** Queue a NUL terminated string from flash memory (PSTR). */
+void
+out_str_P(
+	const char * s
+);
+
+/** Queue the low digits of a value in hex. */
+void
+out_hex(
+	uint32_t val,
+	uint8_t digits
+);
+
+/** Queue a line of bytes as "XX XX ... \r\n". */
+void
+out_hexdump(
+	const uint8_t * buf,
+	uint8_t len
+);
+
+/** Queue bytes as Ascii85, five characters per four bytes.
+ *
+ * A short final group of n bytes gives n+1 characters; there is
+ * no 'z' shorthand so the output length only depends on len.
+ */
+void
+out_base85(
+	const uint8_t * buf,
+	uint8_t len
+);
+
+/** Send whatever is queued.
+ *
+ * Must be called before waiting for the host, or before writing to
+ * the port any other way.
+ */
+void
+out_flush(void);
+
+
+#endif
@@ -44,6 +44,11 @@
 #include "usb_serial.h"
 #include "bits.h"
 #include "xmodem.h"
+#include "timer.h"
+#include "crc.h"
+#include "chips.h"
+#include "task.h"
+#include "out.h"
 
 #define SPI_SS   0xB0 // white
 #define SPI_SCLK 0xB1 // green
@@ -63,19 +68,135 @@
 #define SPI_WIP 1
 #define SPI_WEL 2
 #define SPI_WRITE_ENABLE 0x06
+/* flag status register, program/erase controller ready */
+#define SPI_FSR_READY 0x80
+/* erase, program and protection failure bits, latched until 0x50 */
+#define SPI_FSR_ERRORS 0x32
 
 #define CONFIG_SPI_HW
 
+/* bit-banged Dual/Quad Output Fast Read backend */
+#define CONFIG_SPI_QIO
+
+#ifdef CONFIG_SPI_QIO
+/* flash IO0-IO3 wired to PD0-PD3
+ * IO0/IO1 in parallel with MOSI/MISO, IO2/IO3 are WP#/HOLD#
+ * a whole nibble is sampled with a single IN instruction
+ */
+#define SPI_QIO_PORT    PORTD
+#define SPI_QIO_PIN     PIND
+#define SPI_QIO_DDR     DDRD
+#define SPI_QIO_MASK    0x0F
+/* writing a one to PINx toggles the output, one clock edge per write */
+#define SPI_SCLK_PULSE() do { PINB = (1 << 1); PINB = (1 << 1); } while (0)
+#endif
+
+#define SPI_READ_SINGLE 0
+#define SPI_READ_DUAL   1
+#define SPI_READ_QUAD   2
+
+/* SPI clock dividers, 0 = fosc/2 ... 6 = fosc/128 */
+#define SPI_CLOCK_FASTEST   0
+#define SPI_CLOCK_DEFAULT   1 // fosc/4, 2 MHz
+#define SPI_CLOCK_SLOWEST   6
+
+/* dual-read integrity mode */
+#define INTEGRITY_REGION_SHIFT  20 // errors are counted per 1MB
+#define INTEGRITY_REGIONS       32
+#define INTEGRITY_CLEAN_STREAK  64 // good blocks before speeding up again
+#define INTEGRITY_MAX_RETRIES   8
+
+/* how addresses above 16MB are reached */
+#define SPI_ADDR_3B         0
+#define SPI_ADDR_4B_OPCODES 1 // dedicated 4-byte address opcodes
+#define SPI_ADDR_4B_MODE    2 // enter 4-byte address mode with 0xB7
+
+/* timing benchmark rounds and histogram bins (x4 each from 256us) */
+#define BENCH_ROUNDS    4
+#define BENCH_BINS      8
+
+/* give up on an upload when the host stops sending for this long */
+#define UPLOAD_TIMEOUT  10000 // ms
+
+/* largest patch, bytes are typed in hex */
+#define PATCH_MAX       64
+
+/* bytes a raw batch (X) may read back, held until the batch is done */
+#define RAW_READ_MAX    128
+
 /* size of array to hold possible password locations */
 #define MAX_PWDS    4
 
+/* major.minor, reported by V so host tools can pick what to use */
+#define FIRMWARE_VERSION    0x0200
+
 static xmodem_block_t xmodem_block;
 static uint32_t bytes_uploaded;
+/* spare sector for read-modify-write patches, set with o */
+static uint32_t patch_scratch = UINT32_MAX;
 
 /* default size is 8Mbyte (64 mbits) */
 static uint32_t target_flash_size = 8L << 20;
 
+/* geometry, commands and timings of the attached chip, set by RDID */
+static chip_t chip;
+/* which read command the bulk read paths use */
+static uint8_t spi_read_mode = SPI_READ_SINGLE;
+/* 3 or 4 address bytes, see spi_cmd_addr() */
+static uint8_t spi_addr_mode = SPI_ADDR_3B;
+/* current SPI clock and the one selected by the user */
+static uint8_t spi_clock = SPI_CLOCK_DEFAULT;
+static uint8_t spi_clock_base = SPI_CLOCK_DEFAULT;
+/* read every dump block twice and compare */
+static uint8_t integrity_mode;
+static uint8_t integrity_streak;
+static uint16_t integrity_failed;
+static uint16_t integrity_errors[INTEGRITY_REGIONS];
+static uint16_t integrity_retries[INTEGRITY_REGIONS];
+/* how long the last spi_wait_wip() took, in timer ticks */
+static uint32_t spi_wait_ticks;
+/* and the time limit it had, in ms */
+static uint32_t spi_wait_limit;
+/* status register writes and suspend get this long, in ms */
+#define SPI_WIP_MIN_MS 100
+/* erase limit when the chip entry has no maximum */
+#define SPI_ERASE_MAX_MS 3000
+/* the running operation was cancelled or timed out, loops stop on it */
+static uint8_t spi_aborted;
+/* a CAN from the host asks for it */
+static uint8_t cancel_req;
+/* the host is sending data on the data channel, a CAN there is data */
+static uint8_t host_sending;
+/* a byte read while looking for a CAN, handed to the next reader */
+static int input_pending = -1;
+/* progress frames every this many ms, 0 disables them */
+static uint16_t progress_interval;
+
+/* set by a command that failed, stops a script */
+static uint8_t cmd_failed;
+
+/* script being run by '!', commands read their arguments from it */
+#define SCRIPT_MAX 128
+static char script[SCRIPT_MAX];
+static uint8_t script_len;
+static uint8_t script_pos;
+static uint8_t script_active;
+
+/* background erase, advanced by spi_erase_task() */
+static uint32_t erase_addr;
+static uint32_t erase_end;
+static uint32_t erase_start;    // timer ticks when it was queued
+static uint32_t erase_base;     // first address of the range
+static uint8_t erase_op;        // whole chip command, 0 walks the range
+static uint8_t erase_busy;      // an erase command is running
+static uint8_t erase_suspended; // and it is suspended
+static uint32_t erase_issued;   // timer ticks when it was started or resumed
+static uint32_t erase_limit;    // ms it may take, from spi_op_timeout()
+static uint32_t erase_block;    // start of the running block, it ends at erase_addr
+
 static void spi_erase_sector(uint32_t addr);
+static uint8_t spi_erase_task(void);
+static void spi_erase_reading(uint32_t addr, uint32_t len);
 
 static void
 help(void)
@@ -83,11 +204,21 @@ help(void)
     send_str(PSTR("Help:\r\n"));
     send_str(PSTR("---[ ID commands ]---\r\n"));
     send_str(PSTR("i: print manufacturer and product ID\r\n"));
+    send_str(PSTR("V: capability descriptor for host tools\r\n"));
     
     send_str(PSTR("---[ Read commands ]---\r\n"));
     send_str(PSTR("r: read 16 bytes from address - r0<enter>\r\n"));
     send_str(PSTR("R: read XX bytes from address - R0 10<enter>\r\n"));
+    send_str(PSTR("a: read XX bytes from address as Ascii85 - a0 40<enter>\r\n"));
     send_str(PSTR("d: dump to console\r\n"));
+    send_str(PSTR("m: select single/dual/quad read mode\r\n"));
+    send_str(PSTR("H: CRC16/CRC32 of XX bytes from address - H0 1000<enter>\r\n"));
+    send_str(PSTR("v: verify XX bytes from address against host data - v0 1000<enter>\r\n"));
+    send_str(PSTR("G: dual-read integrity mode for dumps\r\n"));
+    send_str(PSTR("c: set SPI clock\r\n"));
+    send_str(PSTR("T: progress frame interval in ms (hex, 0 = off)\r\n"));
+    send_str(PSTR("M: benchmark program/erase times on a 64k scratch block\r\n"));
+    send_str(PSTR("Y: throughput of SPI, USB TX, USB RX or end to end - Y1 100000<enter>\r\n"));
     send_str(PSTR("w: write enable interactive\r\n"));
     
     send_str(PSTR("---[ Flash commands ]---\r\n"));
@@ -97,34 +228,81 @@ help(void)
     send_str(PSTR("2: flash second ffs\r\n"));
     send_str(PSTR("3: flash third ffs\r\n"));
     send_str(PSTR("S: set target flash size\r\n"));
+    send_str(PSTR("p: patch bytes - p6d8028 2 00 ff<enter>\r\n"));
+    send_str(PSTR("o: set scratch sector for patches - o7ff000<enter>\r\n"));
     
     send_str(PSTR("---[ Erase commands ]---\r\n"));
     send_str(PSTR("e: erase sector interactive\r\n"));
-    send_str(PSTR("E: total erase 8mb\r\n"));
+    send_str(PSTR("E: total erase (flash size set by i or S)\r\n"));
     send_str(PSTR("B: bulk erase Spansion S25FL128S\r\n"));
     send_str(PSTR("Q: bulk erase Micron N25Q064A or Winbond W25Q64FV\r\n"));
     send_str(PSTR("A: bulk erase Macronix MX25L64\r\n"));
+    send_str(PSTR("C: chip erase using the chip database (run i first)\r\n"));
+    send_str(PSTR("P: erase a range with the largest erase units, in the background\r\n"));
+    send_str(PSTR("K: blank check a range\r\n"));
     send_str(PSTR("f: erase firmware password\r\n"));
     send_str(PSTR("l: locate firmware password\r\n"));
+    send_str(PSTR("!: run commands back to back, stop on failure - !i;P0 10000;s<enter>\r\n"));
+    send_str(PSTR("X: raw SPI transaction batch, binary descriptors follow - X1a<enter>\r\n"));
     send_str(PSTR("x:\r\n"));
     send_str(PSTR("download: \r\n"));
 }
 
+/* next byte from the host, -1 if there is none */
+static int
+spi_getchar(void)
+{
+    int c = input_pending;
+    if (c >= 0)
+    {
+        input_pending = -1;
+        return c;
+    }
+    return usb_serial_getchar();
+}
+
+/* option menus are for people, a script only sends the answer */
+static void
+send_menu(const char *s)
+{
+    if (!script_active)
+    {
+        send_str(s);
+    }
+}
+
 static int
 usb_serial_getchar_echo()
 {
+    /* no echo under a script, its end reads as the end of the line
+     * once; a command that wants more than the line has fails
+     */
+    if (script_active)
+    {
+        if (script_pos < script_len)
+        {
+            return script[script_pos++];
+        }
+        if (script_pos > script_len)
+        {
+            cmd_failed = 1;
+        }
+        script_pos = script_len + 1;
+        return '\r';
+    }
+    out_flush();
 	while (1)
 	{
-		int c = usb_serial_getchar();
+		int c = spi_getchar();
 		if (c == -1)
         {
 			continue;
         }
         
-		usb_serial_putchar(c);
+		out_char(c);
 		if (c == '\r')
         {
-			usb_serial_putchar('\n');
+			out_char('\n');
         }
 		return c;
 	}
@@ -133,6 +311,11 @@ usb_serial_getchar_echo()
 static inline void
 spi_power(int i)
 {
+    /* never cut power under a background erase */
+    if (!i && (erase_busy || erase_addr < erase_end))
+    {
+        return;
+    }
 	out(SPI_POW, i);
 }
 
@@ -156,15 +339,7 @@ spi_cs(int i)
 static char
 hexdigit(uint8_t x)
 {
-	x &= 0xF;
-	if (x < 0xA)
-    {
-		return x + '0';
-    }
-	else
-    {
-		return x + 'A' - 0xA;
-    }
+	return pgm_read_byte(&out_hexdigits[x & 0xF]);
 }
 
 // Send a string to the USB serial port.  The string must be in
@@ -172,15 +347,15 @@ hexdigit(uint8_t x)
 //
 void send_str(const char *s)
 {
-    char c;
-    while (1) {
-        c = pgm_read_byte(s++);
-        if (!c)
-        {
-            break;
-        }
-		usb_serial_putchar(c);
-	}
+    out_str_P(s);
+}
+
+/* report an error, marking the command as failed */
+static void
+spi_fail(const char *s)
+{
+    cmd_failed = 1;
+    send_str(s);
 }
 
 static inline uint8_t
@@ -234,28 +409,87 @@ spi_send(uint8_t c)
 	bits[i++] = hexdigit(val >> 0);
 	bits[i++] = '\r';
 	bits[i++] = '\n';
-	usb_serial_write(bits, i);
+	out_write(bits, i);
 
 	return val;
 }
 
+/* map a 3-byte address opcode to its 4-byte address equivalent */
+static uint8_t
+spi_opcode(uint8_t op)
+{
+    if (spi_addr_mode != SPI_ADDR_4B_OPCODES)
+    {
+        return op;
+    }
+    switch (op)
+    {
+        case 0x03: return 0x13; // read
+        case 0x0B: return 0x0C; // fast read
+        case 0x3B: return 0x3C; // dual output fast read
+        case 0x6B: return 0x6C; // quad output fast read
+        case 0x02: return 0x12; // page program
+        case 0x20: return 0x21; // 4k sector erase
+        case 0x52: return 0x5C; // 32k block erase
+        case 0xD8: return 0xDC; // 64k block erase
+        default: return op;
+    }
+}
 
+/* send an address command, CS must already be asserted */
 static void
-spi_passthrough(void)
+spi_cmd_addr(uint8_t op, uint32_t addr)
 {
-	int c = usb_serial_getchar_echo();
-
-	SPDR = c;
-	while (bit_is_clear(SPSR, SPIF))
+    spi_send(spi_opcode(op));
+    /* command is followed by three or four address bytes */
+    if (spi_addr_mode != SPI_ADDR_3B)
     {
-		;
+        spi_send(addr >> 24);
     }
-	uint8_t val = SPDR;
+    spi_send(addr >> 16);
+    spi_send(addr >>  8);
+    spi_send(addr >>  0);
+}
 
-	char buf[2];
-	buf[0] = hexdigit(val >> 4);
-	buf[1] = hexdigit(val >> 0);
-	usb_serial_write(buf, 2);
+/* (re)enter 4-byte address mode
+ * Micron wants write enable before 0xB7, others ignore it
+ * so we always send it and drop WEL again afterwards
+ */
+static void
+spi_enter_4byte(void)
+{
+    spi_cs(1);
+    spi_send(SPI_WRITE_ENABLE);
+    spi_cs(0);
+    spi_cs(1);
+    spi_send(0xB7);
+    spi_cs(0);
+    spi_cs(1);
+    spi_send(0x04);
+    spi_cs(0);
+}
+
+static void
+spi_set_addr_mode(uint8_t mode)
+{
+    /* leave 4-byte mode so 3-byte commands work again */
+    if (spi_addr_mode == SPI_ADDR_4B_MODE && mode != SPI_ADDR_4B_MODE)
+    {
+        spi_cs(1);
+        spi_send(SPI_WRITE_ENABLE);
+        spi_cs(0);
+        spi_cs(1);
+        spi_send(0xE9);
+        spi_cs(0);
+        spi_cs(1);
+        spi_send(0x04);
+        spi_cs(0);
+    }
+    spi_addr_mode = mode;
+    if (mode == SPI_ADDR_4B_MODE)
+    {
+        spi_enter_4byte();
+    }
 }
 
 /* retrieve unique ID available in Micron N25Q064A */
@@ -279,6 +513,71 @@ spi_runiqueid(void)
     return uniqueid;
 }
 
+/* read from the SFDP area, always 3 address bytes and 8 dummy clocks */
+static void
+spi_sfdp_read(uint32_t addr, uint8_t *buf, uint8_t len)
+{
+    spi_cs(1);
+    spi_send(0x5A);
+    spi_send(addr >> 16);
+    spi_send(addr >> 8);
+    spi_send(addr >> 0);
+    spi_send(0x00);
+    for (uint8_t i = 0; i < len; i++)
+    {
+        buf[i] = spi_send(0x00);
+    }
+    spi_cs(0);
+}
+
+/* JESD216 discovery for chips that aren't in the database
+ * returns 1 if the basic flash parameter table was usable
+ */
+static uint8_t
+spi_sfdp(void)
+{
+    uint8_t hdr[SFDP_BFPT_MAX_DWORDS * 4];
+    spi_sfdp_read(0, hdr, SFDP_HEADER_LEN);
+    uint32_t sig = (uint32_t)hdr[3] << 24 | (uint32_t)hdr[2] << 16 | (uint32_t)hdr[1] << 8 | hdr[0];
+    if (sig != SFDP_SIGNATURE)
+    {
+        return 0;
+    }
+    /* number of parameter headers is zero based */
+    uint8_t nph = hdr[6] + 1;
+
+    /* first header is always the BFPT, look for the 4-byte address table */
+    uint32_t bfpt_addr = 0;
+    uint8_t bfpt_len = 0;
+    uint8_t has_4bait = 0;
+    for (uint8_t i = 0; i < nph && i < 8; i++)
+    {
+        uint8_t ph[SFDP_PARAM_LEN];
+        spi_sfdp_read(SFDP_HEADER_LEN + i * SFDP_PARAM_LEN, ph, SFDP_PARAM_LEN);
+        uint16_t id = (uint16_t)ph[7] << 8 | ph[0];
+        if (id == 0xFF00 && bfpt_len == 0)
+        {
+            bfpt_len = ph[3];
+            bfpt_addr = (uint32_t)ph[6] << 16 | (uint32_t)ph[5] << 8 | ph[4];
+        }
+        else if (id == 0xFF84)
+        {
+            has_4bait = 1;
+        }
+    }
+    if (bfpt_len == 0)
+    {
+        return 0;
+    }
+    if (bfpt_len > SFDP_BFPT_MAX_DWORDS)
+    {
+        bfpt_len = SFDP_BFPT_MAX_DWORDS;
+    }
+    spi_sfdp_read(bfpt_addr, hdr, bfpt_len * 4);
+
+    return chip_sfdp_parse(&chip, hdr, bfpt_len, has_4bait);
+}
+
 /** Read electronic manufacturer and device id */
 static void
 spi_rdid(void)
@@ -308,6 +607,14 @@ spi_rdid(void)
     }
 
 	spi_cs(0);
+
+    /* database first, then ask the chip itself */
+    uint8_t known = chip_lookup(&chip, b1, b2, b3);
+    if (!known)
+    {
+        known = spi_sfdp();
+    }
+
 	_delay_ms(1);
 	spi_power(0);
 
@@ -338,65 +645,27 @@ spi_rdid(void)
             send_str(PSTR("Unknown manufacturer "));
             break;
     }
-    if (b2 == 0xBA && b3 == 0x17)
-    {
-        send_str(PSTR("N25Q064A\r\n"));
-    }
-    else if (b2 == 0x20 && b3 == 0x17)
-    {
-        send_str(PSTR("MX25L6406E\r\n"));
-    }
-    else if (b2 == 0x20 && b3 == 0x14)
-    {
-        send_str(PSTR("MX25L8006E (8 Mbit)\r\n"));
-    }
-    else if (b2 == 0x20 && b3 == 0x15)
-    {
-        send_str(PSTR("MX25L1606E (16 Mbit)\r\n"));
-    }
-    else if (b2 == 0x20 && b3 == 0x18)
-    {
-        send_str(PSTR("S25FL128S/P\r\n"));
-    }
-    else if (b2 == 0x2 && b3 == 0x19)
-    {
-        send_str(PSTR("S25FL256S/P\r\n"));
-    }
-    else if (b2 == 0x15 && b3 == 0x20)
-    {
-        send_str(PSTR("EN25P16\r\n"));
-    }
-    else if (b2 == 0x25 && b3 == 0x8D)
-    {
-        send_str(PSTR("SST25VF040B (4 Mbit)\r\n"));
-    }
-    else if (b2 == 0x25 && b3 == 0x8E)
-    {
-        send_str(PSTR("SST25VF080B (8 Mbit)\r\n"));
-    }
-    else if (b2 == 0x25 && b3 == 0x41)
-    {
-        send_str(PSTR("SST25VF016B (16 Mbit)\r\n"));
-    }
-    else if (b2 == 0x25 && b3 == 0x4A)
-    {
-        send_str(PSTR("SST25VF032B (32 Mbit)\r\n"));
-    }
-    else if (b1 == 0x7F && b2 == 0x9D && b3 == 0x20)
-    {
-        send_str(PSTR("Pm25LD512 (512 Kbit)\r\n"));
-    }
-    else if (b1 == 0x7F && b2 == 0x9D && b3 == 0x21)
-    {
-        send_str(PSTR("Pm25LD010 (1 Mbit)\r\n"));
-    }
-    else if (b1 == 0x7F && b2 == 0x9D && b3 == 0x22)
-    {
-        send_str(PSTR("Pm25LD020 (2 Mbit)\r\n"));
-    }
-    else
+    out_write(chip.name, strnlen(chip.name, CHIP_NAME_LEN));
+    send_str(PSTR("\r\n"));
+
+    /* configure size and addressing for chips we know about,
+     * anything else keeps what was set with the S command
+     */
+    if (known)
     {
-        send_str(PSTR("unknown chip\r\n"));
+        target_flash_size = 1L << chip.size_shift;
+        if (target_flash_size <= (16L << 20))
+        {
+            spi_set_addr_mode(SPI_ADDR_3B);
+        }
+        else if (chip.flags & CHIP_4B_OPCODES)
+        {
+            spi_set_addr_mode(SPI_ADDR_4B_OPCODES);
+        }
+        else
+        {
+            spi_set_addr_mode(SPI_ADDR_4B_MODE);
+        }
     }
     
     char buf[32] = {0};
@@ -425,7 +694,7 @@ spi_rdid(void)
 	buf[off++] = '\r';
 	buf[off++] = '\n';
 
-	usb_serial_write(buf, off);
+	out_write(buf, off);
 }
 
 /* read status register */
@@ -440,172 +709,1192 @@ spi_status(void)
 	return r1;
 }
 
-static uint32_t
-usb_serial_readhex(void)
-{
-	uint32_t val = 0;
+/* set by a '?' on the control interface, the next frame goes out
+ * regardless of the interval
+ */
+static uint8_t progress_now;
 
-	while (1)
-	{
-        int c = usb_serial_getchar_echo();
-        if ('0' <= c && c <= '9')
-        {
-            val = (val << 4) | (c - '0');
-        }
-        else
-        {
-            if ('A' <= c && c <= 'F')
-            {
-                val = (val << 4) | (c - 'A' + 0xA);
-            }
-            else
-            {
-                if ('a' <= c && c <= 'f')
-                {
-                    val = (val << 4) | (c - 'a' + 0xA);
-                }
-                else
-                {
-                    return val;
-                }
-            }
-        }
-	}
+static uint8_t
+progress_hex(char *buf, uint32_t val)
+{
+    for (uint8_t i = 0; i < 8; i++)
+    {
+        buf[i] = hexdigit(val >> (28 - 4 * i));
+    }
+    buf[8] = ' ';
+    return 9;
 }
 
-/* write enable the flash */
-/* must be always set before writing */
+/* s on the control interface, the s counters as one record:
+ * #S uploaded wait-us erase-addr erase-end, erase-addr == erase-end
+ * once no erase is left
+ */
 static void
-spi_write_enable(void)
+spi_ctrl_stats(void)
 {
-	spi_power(1);
-	_delay_ms(2);
-    /* retrieve status */
-	uint8_t r1 = spi_status();
-    /* XXX: check status ? */
-	spi_cs(1);
-	spi_send(SPI_WRITE_ENABLE);
-	spi_cs(0);
+    char buf[3 + 4 * 9];
+    uint8_t off = 0;
+    buf[off++] = '#';
+    buf[off++] = 'S';
+    buf[off++] = ' ';
+    off += progress_hex(&buf[off], bytes_uploaded);
+    off += progress_hex(&buf[off], spi_wait_ticks * TIMER_US_PER_TICK);
+    off += progress_hex(&buf[off], erase_addr);
+    off += progress_hex(&buf[off], erase_end);
+    buf[off - 1] = '\r';
+    buf[off++] = '\n';
+    usb_ctrl_write((const uint8_t *)buf, off);
 }
 
-
+/* requests on the control interface, read between the chunks of a
+ * running operation so they never wait behind the data channel
+ */
 static void
-spi_write_enable_interactive(void)
+spi_ctrl_poll(void)
 {
-	spi_write_enable();
-
-	uint8_t r2 = spi_status();
-
-	char buf[16];
-	uint8_t off =0;
-	buf[off++] = hexdigit(r2 >> 4);
-	buf[off++] = hexdigit(r2 >> 0);
-	if ((r2 & SPI_WEL) == 0)
+    int16_t c;
+    while ((c = usb_ctrl_getchar()) >= 0)
     {
-		buf[off++] = '!';
+        switch (c)
+        {
+            case '?': progress_now = 1; break;
+            case 's': spi_ctrl_stats(); break;
+            case XMODEM_CAN: cancel_req = 1; break;
+            default: break;
+        }
     }
-    
-	buf[off++] = '\r';
-	buf[off++] = '\n';
-	usb_serial_write(buf, off);
 }
 
+/* nothing is running that would answer a status request */
 static void
-print_address(uint32_t addr, uint8_t newline)
+spi_ctrl_idle(void)
 {
-    uint8_t addr_buf[16] = {0};
-    uint8_t off = 0;
-    addr_buf[off++] = '0';
-    addr_buf[off++] = 'x';
-    addr_buf[off++] = hexdigit(addr >> 20);
-    addr_buf[off++] = hexdigit(addr >> 16);
-    addr_buf[off++] = hexdigit(addr >> 12);
-    addr_buf[off++] = hexdigit(addr >> 8);
-    addr_buf[off++] = hexdigit(addr >> 4);
-    addr_buf[off++] = hexdigit(addr >> 0);
-    if (newline)
+    spi_ctrl_poll();
+    if (progress_now && !task_count())
     {
-        addr_buf[off++] = '\r';
-        addr_buf[off++] = '\n';
+        static const char idle[] = "#I\r\n";
+        usb_ctrl_write((const uint8_t *)idle, sizeof(idle) - 1);
+        progress_now = 0;
     }
-    usb_serial_write(addr_buf, off);
 }
 
-/* locate NVRAM variable(s) that hold the firmware passowrd */
-static void
-spi_locate_pwd(void)
+/* look for a CAN on the control interface, or on the data channel
+ * when it isn't carrying host data, a script or a protocol
+ */
+static uint8_t
+spi_cancel_poll(void)
 {
-    uint32_t start_addr = 0;
-    const uint32_t end_addr = 8L << 20;
-
-    spi_power(1);
-    _delay_ms(2);
-    spi_cs(1);
-    // read a page
-    spi_send(0x03);
-    /* command is followed by three address bytes */
-    spi_send(start_addr >> 16);
-    spi_send(start_addr >>  8);
-    spi_send(start_addr >>  0);
-    uint8_t data[256];
-
-    uint32_t led_on = 1;
-    uint32_t led_count = 0;
-    /* turn LED on if it wasn't already */
-    out(0xD6, 1);
-    send_str(PSTR("Locating passwords...\r\n"));
-    
-    while (1)
+    spi_ctrl_poll();
+    if (!host_sending && !script_active && input_pending < 0)
     {
-        for (int i = 0 ; i < 256 ; i++)
+        input_pending = usb_serial_getchar();
+        if (input_pending == XMODEM_CAN)
         {
-            data[i] = spi_send(0);
+            input_pending = -1;
+            cancel_req = 1;
         }
-        /* turn on/off led */
-        if (led_count == 0x50)
-        {
-            if (led_on == 0)
-            {
-                out(0xD6, 1);
-                led_on = 1;
-            }
-            else if (led_on == 1)
-            {
-                led_on = 0;
-                out(0xD6,0);
-            }
-            led_count = 0;
+    }
+    return cancel_req;
+}
+
+/* get the flash idle again after an abort.  The power pin isn't driven
+ * (see main()), so nothing resets the chip for us: a suspended erase is
+ * resumed rather than left half done, WRDI drops a pending write enable,
+ * then chips with a software reset get one and the others have limit_ms
+ * to finish what they are doing.  A reset leaves 3-byte addressing,
+ * spi_write_enable() enters the 4-byte mode again.
+ * returns non-zero if the chip is still busy
+ */
+static uint8_t
+spi_recover(uint32_t limit_ms)
+{
+    if (erase_suspended)
+    {
+        spi_cs(1);
+        spi_send(chip.resume_op);
+        spi_cs(0);
+    }
+    spi_cs(1);
+    spi_send(0x04);
+    spi_cs(0);
+    if (chip.flags & CHIP_SOFT_RESET)
+    {
+        spi_cs(1);
+        spi_send(0x66);
+        spi_cs(0);
+        spi_cs(1);
+        spi_send(0x99);
+        spi_cs(0);
+        _delay_ms(1);
+    }
+    const uint32_t start = timer_ticks();
+    while (spi_status() & SPI_WIP)
+    {
+        if (timer_ticks() - start > limit_ms * TIMER_TICKS_PER_MS)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* stop a cancelled or hung operation and recover the flash, the
+ * command fails
+ */
+static void
+spi_abort(const char *msg)
+{
+    const uint32_t limit = erase_busy ? erase_limit : spi_wait_limit;
+    spi_cs(0);
+    task_stop(spi_erase_task);
+    const uint8_t busy = spi_recover(limit);
+    erase_busy = 0;
+    erase_suspended = 0;
+    erase_addr = erase_end;
+    spi_power(0);
+    cancel_req = 0;
+    spi_aborted = 1;
+    /* the rest of an upload the host still had in flight isn't commands */
+    if (host_sending)
+    {
+        do
+        {
+            usb_serial_flush_input();
+            _delay_ms(50);
+        } while (usb_serial_available());
+    }
+    spi_fail(msg);
+    if (busy)
+    {
+        spi_fail(PSTR("flash still busy, power cycle it\r\n"));
+    }
+}
+
+/* long loops call this between chunks, non-zero means stop */
+static uint8_t
+spi_cancelled(void)
+{
+    if (!spi_aborted && spi_cancel_poll())
+    {
+        spi_abort(PSTR("cancelled\r\n"));
+    }
+    return spi_aborted;
+}
+
+/* ms a program/erase/register write may take before it counts as hung,
+ * twice the datasheet maximum plus some slack for register writes;
+ * only the *_max fields are used, M never touches those
+ */
+static uint32_t
+spi_op_timeout(uint8_t op)
+{
+    uint32_t ms = chip.tbe_max ? chip.tbe_max : SPI_ERASE_MAX_MS;
+    switch (op)
+    {
+        case 0x02: ms = chip.tpp_max / 1000; break;
+        case 0x20: ms = chip.tse_max ? chip.tse_max : SPI_ERASE_MAX_MS; break;
+        case 0x52: case 0xD8: break;
+        case 0x60: case 0xC7:
+            ms = chip.tce_max ? chip.tce_max : ms << (chip.size_shift - 16);
+            break;
+        default: ms = 0; break;
+    }
+    return 2 * ms + SPI_WIP_MIN_MS;
+}
+
+/* FSR parts latch a failed program or erase (or one aimed at a
+ * protected sector) in the flag status register instead of failing
+ * silently; clear the flags and fail the operation if one is set
+ * returns non-zero on failure
+ */
+static uint8_t
+spi_fsr_failed(void)
+{
+    if (!(chip.flags & CHIP_FSR))
+    {
+        return 0;
+    }
+    spi_cs(1);
+    spi_send(0x70);
+    const uint8_t fsr = spi_send(0x00);
+    spi_cs(0);
+    if (!(fsr & SPI_FSR_ERRORS))
+    {
+        return 0;
+    }
+    spi_cs(1);
+    spi_send(0x50);
+    spi_cs(0);
+    spi_abort(fsr & 0x02 ? PSTR("flash refused, sector protected\r\n")
+                         : PSTR("flash reported a program/erase failure\r\n"));
+    return 1;
+}
+
+/* wait for a program/erase/register write to finish
+ * CS is kept low and the status register clocked out continuously
+ * so completion is seen within a few SPI clocks, every 256 reads the
+ * time limit (see spi_op_timeout()) and cancel requests are checked,
+ * FSR error flags once the chip is ready
+ * returns the time spent waiting in timer ticks
+ */
+static uint32_t
+spi_wait_wip(uint32_t limit_ms)
+{
+    const uint32_t start = timer_ticks();
+    spi_wait_limit = limit_ms;
+    uint8_t op = 0x05;
+    uint8_t mask = SPI_WIP;
+    uint8_t ready = 0;
+    if (chip.flags & CHIP_FSR)
+    {
+        op = 0x70;
+        mask = SPI_FSR_READY;
+        ready = SPI_FSR_READY;
+    }
+    uint8_t n = 0;
+	spi_cs(1);
+    spi_send(op);
+    while ((spi_send(0x00) & mask) != ready)
+    {
+        if (++n)
+        {
+            continue;
+        }
+        if (timer_ticks() - start > limit_ms * TIMER_TICKS_PER_MS)
+        {
+            spi_abort(PSTR("timeout\r\n"));
+            break;
+        }
+        if (spi_cancelled())
+        {
+            break;
+        }
+    }
+	spi_cs(0);
+    if (!spi_aborted)
+    {
+        spi_fsr_failed();
+    }
+    spi_wait_ticks = timer_ticks() - start;
+    return spi_wait_ticks;
+}
+
+static uint32_t
+usb_serial_readhex(void)
+{
+	uint32_t val = 0;
+
+	while (1)
+	{
+        int c = usb_serial_getchar_echo();
+        if ('0' <= c && c <= '9')
+        {
+            val = (val << 4) | (c - '0');
+        }
+        else
+        {
+            if ('A' <= c && c <= 'F')
+            {
+                val = (val << 4) | (c - 'A' + 0xA);
+            }
+            else
+            {
+                if ('a' <= c && c <= 'f')
+                {
+                    val = (val << 4) | (c - 'a' + 0xA);
+                }
+                else
+                {
+                    return val;
+                }
+            }
+        }
+	}
+}
+
+/* write enable the flash */
+/* must be always set before writing */
+static void
+spi_write_enable(void)
+{
+    /* only wait for the flash to power up if it was off */
+    if (bit_is_clear(PORTB, 7))
+    {
+        spi_power(1);
+        _delay_ms(2);
+    }
+    /* chip might have been reset since, make sure it's still in 4-byte mode */
+    if (spi_addr_mode == SPI_ADDR_4B_MODE)
+    {
+        spi_enter_4byte();
+    }
+	spi_cs(1);
+	spi_send(SPI_WRITE_ENABLE);
+	spi_cs(0);
+    /* a protected, busy or absent chip ignores it, don't go on
+     * programming or erasing into nothing
+     */
+    if (!spi_aborted && (spi_status() & SPI_WEL) == 0)
+    {
+        spi_abort(PSTR("write enable failed, WEL not set\r\n"));
+    }
+}
+
+
+static void
+spi_write_enable_interactive(void)
+{
+	spi_write_enable();
+
+	uint8_t r2 = spi_status();
+
+	char buf[16];
+	uint8_t off =0;
+	buf[off++] = hexdigit(r2 >> 4);
+	buf[off++] = hexdigit(r2 >> 0);
+	if ((r2 & SPI_WEL) == 0)
+    {
+		buf[off++] = '!';
+    }
+    
+	buf[off++] = '\r';
+	buf[off++] = '\n';
+	out_write(buf, off);
+}
+
+/* SST parts power up with every block write protected,
+ * clear BP bits with EWSR + WRSR before erasing or programming
+ */
+static void
+spi_unprotect(void)
+{
+    if (!(chip.flags & CHIP_SST_AAI))
+    {
+        return;
+    }
+    spi_power(1);
+    spi_cs(1);
+    spi_send(0x50);
+    spi_cs(0);
+    spi_cs(1);
+    spi_send(0x01);
+    spi_send(0x00);
+    spi_cs(0);
+    spi_wait_wip(spi_op_timeout(0x01));
+}
+
+/* one page program command, must not cross a page boundary */
+static void
+spi_program_page(uint32_t addr, const uint8_t *buf, uint16_t len)
+{
+    /* the operation was aborted, don't program the rest */
+    if (spi_aborted)
+    {
+        return;
+    }
+    spi_write_enable();
+    spi_cs(1);
+    spi_cmd_addr(0x02, addr);
+    while (len--)
+    {
+        spi_send(*buf++);
+    }
+    spi_cs(0);
+    spi_wait_wip(spi_op_timeout(0x02));
+}
+
+/* SST auto address increment word program
+ * only the first word carries the address, odd edges are byte programmed
+ */
+static void
+spi_program_aai(uint32_t addr, const uint8_t *buf, uint16_t len)
+{
+    if ((addr & 1) && len)
+    {
+        spi_program_page(addr++, buf++, 1);
+        len--;
+    }
+    if (len >= 2)
+    {
+        spi_write_enable();
+        spi_cs(1);
+        spi_cmd_addr(0xAD, addr);
+        spi_send(buf[0]);
+        spi_send(buf[1]);
+        spi_cs(0);
+        spi_wait_wip(spi_op_timeout(0x02));
+        addr += 2;
+        buf += 2;
+        len -= 2;
+
+        while (len >= 2 && !spi_aborted)
+        {
+            spi_cs(1);
+            spi_send(0xAD);
+            spi_send(buf[0]);
+            spi_send(buf[1]);
+            spi_cs(0);
+            spi_wait_wip(spi_op_timeout(0x02));
+            addr += 2;
+            buf += 2;
+            len -= 2;
+        }
+        /* WRDI ends AAI mode */
+        spi_cs(1);
+        spi_send(0x04);
+        spi_cs(0);
+        spi_wait_wip(spi_op_timeout(0x04));
+    }
+    if (len)
+    {
+        spi_program_page(addr, buf, 1);
+    }
+}
+
+/* program len bytes at addr with whatever the chip supports */
+static void
+spi_program(uint32_t addr, const uint8_t *buf, uint16_t len)
+{
+    if (chip.flags & CHIP_SST_AAI)
+    {
+        spi_program_aai(addr, buf, len);
+        return;
+    }
+    /* split at page boundaries, no page program means one byte at a time */
+    const uint16_t page = 1 << chip.page_shift;
+    while (len)
+    {
+        uint16_t n = page - (addr & (page - 1));
+        if (n > len)
+        {
+            n = len;
+        }
+        spi_program_page(addr, buf, n);
+        addr += n;
+        buf += n;
+        len -= n;
+    }
+}
+
+/* datasheet time to program len more bytes, in ms */
+static uint32_t
+spi_program_eta(uint32_t len)
+{
+    uint32_t ops = len >> chip.page_shift;
+    if (chip.flags & CHIP_SST_AAI)
+    {
+        ops = len / 2;
+    }
+    return ops * chip.tpp_typ / 1000;
+}
+
+#ifdef CONFIG_SPI_QIO
+/* set the quad enable bit on chips that gate IO2/IO3 behind it
+ * returns 0 if we don't know how to do it for the attached chip
+ */
+static uint8_t
+spi_quad_enable(void)
+{
+    uint8_t sr1 = spi_status();
+    /* Micron N25Q quad output read works without any QE bit */
+    if (chip.flags & CHIP_QUAD)
+    {
+        return 1;
+    }
+    /* Macronix QE is bit 6 of the status register */
+    else if (chip.flags & CHIP_QE_SR1_BIT6)
+    {
+        if (sr1 & 0x40)
+        {
+            return 1;
+        }
+        spi_write_enable();
+        spi_cs(1);
+        spi_send(0x01);
+        spi_send(sr1 | 0x40);
+        spi_cs(0);
+    }
+    /* Winbond status register 2 and Spansion configuration register
+     * are both read with 0x35 and have QE in bit 1
+     * and both are written together with the status register
+     */
+    else if (chip.flags & CHIP_QE_SR2_BIT1)
+    {
+        spi_cs(1);
+        spi_send(0x35);
+        uint8_t sr2 = spi_send(0x00);
+        spi_cs(0);
+        if (sr2 & 0x02)
+        {
+            return 1;
+        }
+        spi_write_enable();
+        spi_cs(1);
+        spi_send(0x01);
+        spi_send(sr1);
+        spi_send(sr2 | 0x02);
+        spi_cs(0);
+    }
+    else
+    {
+        return 0;
+    }
+    // wait for the status register write to finish
+    spi_wait_wip(spi_op_timeout(0x01));
+    return 1;
+}
+
+/* switch the bus over to the bit-banged data phase */
+static void
+spi_qio_begin(void)
+{
+#ifdef CONFIG_SPI_HW
+    /* take SCLK back from the SPI block, it stays low from PORTB */
+    cbi(SPCR, SPE);
+#endif
+    /* release MOSI so the flash can drive IO0 */
+    cbi(DDRB, 2);
+}
+
+static void
+spi_qio_end(void)
+{
+    sbi(DDRB, 2);
+#ifdef CONFIG_SPI_HW
+    sbi(SPCR, SPE);
+#endif
+}
+
+/* the flash shifts out on the falling edge so the next bits
+ * are already on the bus when we sample before each rising edge
+ */
+static void
+spi_qio_read(uint8_t *buf, uint16_t len)
+{
+    if (spi_read_mode == SPI_READ_QUAD)
+    {
+        while (len--)
+        {
+            uint8_t hi = SPI_QIO_PIN;
+            SPI_SCLK_PULSE();
+            uint8_t lo = SPI_QIO_PIN & SPI_QIO_MASK;
+            SPI_SCLK_PULSE();
+            *buf++ = (hi << 4) | lo;
+        }
+    }
+    else
+    {
+        while (len--)
+        {
+            uint8_t val = SPI_QIO_PIN & 0x03;
+            SPI_SCLK_PULSE();
+            val = (val << 2) | (SPI_QIO_PIN & 0x03);
+            SPI_SCLK_PULSE();
+            val = (val << 2) | (SPI_QIO_PIN & 0x03);
+            SPI_SCLK_PULSE();
+            val = (val << 2) | (SPI_QIO_PIN & 0x03);
+            SPI_SCLK_PULSE();
+            *buf++ = val;
+        }
+    }
+}
+
+static void
+spi_change_read_mode(void)
+{
+    send_menu(PSTR("Select read mode:\r\n"));
+    send_menu(PSTR("0 - Single (0x03)\r\n"));
+    send_menu(PSTR("1 - Dual Output Fast Read (0x3B)\r\n"));
+    send_menu(PSTR("2 - Quad Output Fast Read (0x6B)\r\n"));
+    uint32_t mode = usb_serial_readhex();
+
+    switch (mode) {
+        case SPI_READ_SINGLE:
+        case SPI_READ_DUAL:
+            spi_read_mode = mode;
+            break;
+        case SPI_READ_QUAD:
+            if (spi_quad_enable() == 0)
+            {
+                spi_fail(PSTR("ERROR: don't know how to enable quad mode, read chip ID first.\r\n"));
+                break;
+            }
+            spi_read_mode = mode;
+            break;
+        default:
+            spi_fail(PSTR("ERROR: Invalid read mode selected.\r\n"));
+            break;
+    }
+}
+#endif
+
+/* streaming reads for the compute kernels
+ * with hardware SPI the next byte is already shifting while the
+ * caller works on the one just returned, so work per byte is hidden
+ * up to the shift time (16 CPU cycles at fosc/2, 32 at fosc/4).
+ * The checksum, compare and blank kernels fit in that; the CRC
+ * kernel (CRC-16 shifts plus a PROGMEM CRC-32 table lookup) doesn't,
+ * so H is slower than a plain read, only less so than reading first
+ */
+static inline void
+spi_stream_start(void)
+{
+#ifdef CONFIG_SPI_HW
+    if (spi_read_mode == SPI_READ_SINGLE)
+    {
+        SPDR = 0;
+    }
+#endif
+}
+
+/* return the byte that was shifting and start the next one if more follow */
+static inline uint8_t
+spi_stream_next(uint8_t more)
+{
+#ifdef CONFIG_SPI_HW
+    if (spi_read_mode == SPI_READ_SINGLE)
+    {
+        while (bit_is_clear(SPSR, SPIF))
+        {
+            ;
         }
-        led_count++;
-        /* compare GUID */
-        for (int i = 0; i < 255; i++)
+        uint8_t b = SPDR;
+        if (more)
+        {
+            SPDR = 0;
+        }
+        return b;
+    }
+#endif
+#ifdef CONFIG_SPI_QIO
+    if (spi_read_mode != SPI_READ_SINGLE)
+    {
+        uint8_t b;
+        spi_qio_read(&b, 1);
+        return b;
+    }
+#endif
+    return spi_send(0);
+}
+
+/* start a streaming read at addr with the selected read mode */
+static void
+spi_read_begin(uint32_t addr)
+{
+    if (spi_addr_mode == SPI_ADDR_4B_MODE)
+    {
+        spi_enter_4byte();
+    }
+    spi_cs(1);
+#ifdef CONFIG_SPI_QIO
+    if (spi_read_mode != SPI_READ_SINGLE)
+    {
+        spi_cmd_addr(spi_read_mode == SPI_READ_QUAD ? 0x6B : 0x3B, addr);
+        /* eight dummy clocks */
+        spi_send(0x00);
+        spi_qio_begin();
+        return;
+    }
+#endif
+    spi_cmd_addr(0x03, addr);
+}
+
+/* read the next len bytes of a read started with spi_read_begin() */
+static void
+spi_read_block(uint8_t *buf, uint16_t len)
+{
+#ifdef CONFIG_SPI_QIO
+    if (spi_read_mode != SPI_READ_SINGLE)
+    {
+        spi_qio_read(buf, len);
+        return;
+    }
+#endif
+    spi_stream_start();
+    while (len--)
+    {
+        *buf++ = spi_stream_next(len != 0);
+    }
+}
+
+static void
+spi_read_end(void)
+{
+    /* set clock signal high to end the operation */
+    spi_cs(0);
+#ifdef CONFIG_SPI_QIO
+    /* only drive MOSI again once the flash released IO0 */
+    if (spi_read_mode != SPI_READ_SINGLE)
+    {
+        spi_qio_end();
+    }
+#endif
+}
+
+/* read len bytes into buf and return their xmodem checksum */
+static uint8_t
+spi_read_cksum(uint8_t *buf, uint16_t len)
+{
+    uint8_t cksum = 0;
+    spi_stream_start();
+    while (len--)
+    {
+        uint8_t b = spi_stream_next(len != 0);
+        *buf++ = b;
+        cksum += b;
+    }
+    return cksum;
+}
+
+/* CRC-16/XMODEM and CRC-32 of the next len bytes, nothing is stored */
+static void
+spi_read_crc(uint16_t len, uint16_t *crc16, uint32_t *crc32)
+{
+    uint16_t c16 = *crc16;
+    uint32_t c32 = *crc32;
+    spi_stream_start();
+    while (len--)
+    {
+        uint8_t b = spi_stream_next(len != 0);
+        c16 = crc16_update(c16, b);
+        c32 = crc32_update(c32, b);
+    }
+    *crc16 = c16;
+    *crc32 = c32;
+}
+
+/* compare the next len bytes against buf
+ * returns the offset of the first difference or len if they match
+ */
+static uint16_t
+spi_read_diff(const uint8_t *buf, uint16_t len)
+{
+    uint16_t diff = len;
+    spi_stream_start();
+    for (uint16_t i = 0; i < len; i++)
+    {
+        uint8_t b = spi_stream_next(i + 1 != len);
+        if (b != buf[i] && diff == len)
+        {
+            diff = i;
+        }
+    }
+    return diff;
+}
+
+/* read until the first byte that isn't 0xFF, at most len bytes
+ * returns its offset or len if they were all erased
+ */
+static uint16_t
+spi_read_blank(uint16_t len)
+{
+    spi_stream_start();
+    for (uint16_t i = 0; i < len; i++)
+    {
+        uint8_t more = i + 1 != len;
+        if (spi_stream_next(more) != 0xFF)
         {
-            if (data[i] == 0xFF && data[i+1] == 0x23)
+            /* collect the byte that is already shifting */
+            if (more)
             {
-                if (i < 254 && data[i+2] == 0x80)
-                {
-                    send_str(PSTR("Found potential password at address: "));
-                    print_address(start_addr + i, 1);
-                }
+                spi_stream_next(0);
+            }
+            return i;
+        }
+    }
+    return len;
+}
+
+/* first address in [addr, addr+len) that isn't erased, UINT32_MAX if none */
+static uint32_t
+spi_blank_check(uint32_t addr, uint32_t len)
+{
+    uint32_t dirty = UINT32_MAX;
+    spi_read_begin(addr);
+    while (len)
+    {
+        uint16_t chunk = len > 0x8000 ? 0x8000 : len;
+        uint16_t off = spi_read_blank(chunk);
+        if (off != chunk)
+        {
+            dirty = addr + off;
+            break;
+        }
+        addr += chunk;
+        len -= chunk;
+        /* a cancelled check counts as dirty, nothing is skipped on it */
+        if (len && spi_cancelled())
+        {
+            dirty = addr;
+            break;
+        }
+    }
+    spi_read_end();
+    return dirty;
+}
+
+/* pattern matcher state, kept across calls so matches can span chunks */
+static uint32_t spi_scan_pos;
+static uint8_t spi_scan_state;
+
+static void
+spi_scan_reset(void)
+{
+    spi_scan_pos = 0;
+    spi_scan_state = 0;
+}
+
+/* scan the next len bytes for pat and call found() with the offset,
+ * relative to the last spi_scan_reset(), of every match.
+ * the first byte of pat must not appear again in it, so on a
+ * mismatch we only have to check for a new start.
+ */
+static void
+spi_scan(uint16_t len, const uint8_t *pat, uint8_t patlen, void (*found)(uint32_t))
+{
+    uint8_t state = spi_scan_state;
+    uint32_t pos = spi_scan_pos;
+    spi_stream_start();
+    while (len--)
+    {
+        uint8_t b = spi_stream_next(len != 0);
+        pos++;
+        if (b == pat[state])
+        {
+            if (++state == patlen)
+            {
+                found(pos - patlen);
+                state = 0;
+            }
+        }
+        else
+        {
+            state = (b == pat[0]);
+        }
+    }
+    spi_scan_state = state;
+    spi_scan_pos = pos;
+}
+
+static void
+spi_set_clock(uint8_t level)
+{
+    if (level > SPI_CLOCK_SLOWEST)
+    {
+        level = SPI_CLOCK_SLOWEST;
+    }
+    spi_clock = level;
+#ifdef CONFIG_SPI_HW
+    /* even levels use the double speed bit, except fosc/128 */
+    SPCR = (SPCR & ~((1 << SPR1) | (1 << SPR0))) | (level >> 1);
+    if ((level & 1) || level == SPI_CLOCK_SLOWEST)
+    {
+        cbi(SPSR, SPI2X);
+    }
+    else
+    {
+        sbi(SPSR, SPI2X);
+    }
+#endif
+}
+
+/* read the block again and compare, 16 bytes at a time */
+static uint8_t
+spi_read_compare(uint32_t addr, const uint8_t *buf, uint16_t len)
+{
+    uint8_t data[16];
+    uint8_t diff = 0;
+
+    spi_read_begin(addr);
+    while (len)
+    {
+        uint8_t n = len < sizeof(data) ? len : sizeof(data);
+        spi_read_block(data, n);
+        for (uint8_t i = 0; i < n; i++)
+        {
+            diff |= data[i] ^ *buf++;
+        }
+        len -= n;
+    }
+    spi_read_end();
+    return diff;
+}
+
+/* read a block twice, on mismatch drop the SPI clock and read again
+ * until two reads agree. the clock goes back up after a streak of
+ * clean blocks.
+ * returns 0 if the block is good, -1 if the reads never agreed
+ */
+static int8_t
+spi_read_verified(uint32_t addr, uint8_t *buf, uint16_t len)
+{
+    uint8_t region = addr >> INTEGRITY_REGION_SHIFT;
+    if (region >= INTEGRITY_REGIONS)
+    {
+        region = INTEGRITY_REGIONS - 1;
+    }
+    /* the bit-banged modes run at a fixed speed so fall back
+     * to single reads while the clock is lowered
+     */
+    const uint8_t read_mode = spi_read_mode;
+    if (spi_clock != spi_clock_base)
+    {
+        spi_read_mode = SPI_READ_SINGLE;
+    }
+
+    int8_t ret = 0;
+    uint8_t retries = 0;
+    spi_read_begin(addr);
+    spi_read_block(buf, len);
+    spi_read_end();
+
+    while (spi_read_compare(addr, buf, len) != 0)
+    {
+        if (retries == 0)
+        {
+            integrity_errors[region]++;
+        }
+        integrity_retries[region]++;
+        integrity_streak = 0;
+        if (++retries > INTEGRITY_MAX_RETRIES)
+        {
+            integrity_failed++;
+            ret = -1;
+            break;
+        }
+        spi_set_clock(spi_clock + 1);
+        spi_read_mode = SPI_READ_SINGLE;
+
+        spi_read_begin(addr);
+        spi_read_block(buf, len);
+        spi_read_end();
+    }
+
+    if (retries == 0 && spi_clock > spi_clock_base
+        && ++integrity_streak >= INTEGRITY_CLEAN_STREAK)
+    {
+        spi_set_clock(spi_clock - 1);
+        integrity_streak = 0;
+    }
+    spi_read_mode = read_mode;
+    return ret;
+}
+
+static void
+integrity_reset(void)
+{
+    memset(integrity_errors, 0, sizeof(integrity_errors));
+    memset(integrity_retries, 0, sizeof(integrity_retries));
+    integrity_failed = 0;
+    integrity_streak = 0;
+    spi_set_clock(spi_clock_base);
+}
+
+static void
+print_address(uint32_t addr, uint8_t newline)
+{
+    send_str(PSTR("0x"));
+    out_hex(addr, (addr >> 24) ? 8 : 6);
+    if (newline)
+    {
+        send_str(PSTR("\r\n"));
+    }
+}
+
+/* state of one operation reporting progress */
+typedef struct
+{
+    uint32_t start;  // timer ticks
+    uint32_t last;   // when the last frame went out
+    uint8_t binary;  // data channel carries binary, frames only go to the control interface
+} progress_t;
+
+static void
+spi_progress_begin(progress_t *p, uint8_t binary)
+{
+    p->start = p->last = timer_ticks();
+    p->binary = binary;
+}
+
+/* rate from a byte count and ms, without overflowing 32 bits */
+static uint32_t
+bytes_per_sec(uint32_t bytes, uint32_t ms)
+{
+    if (ms == 0)
+    {
+        return 0;
+    }
+    return (bytes / ms) * 1000 + ((bytes % ms) * 1000) / ms;
+}
+
+/* would spi_progress() send a frame now?  Lets callers skip working
+ * out an expensive ETA that would be thrown away
+ */
+static uint8_t
+spi_progress_due(const progress_t *p)
+{
+    spi_ctrl_poll();
+    if (p->binary && !usb_ctrl_open())
+    {
+        return 0;
+    }
+    if (progress_now)
+    {
+        return 1;
+    }
+    return progress_interval != 0
+        && timer_ticks() - p->last >= (uint32_t)progress_interval * TIMER_TICKS_PER_MS;
+}
+
+/* machine readable progress frame, at most one per progress_interval
+ * or when asked for on the control interface:
+ * #P<op> done total elapsed-ticks bytes/s eta-ms
+ * the ETA is the larger of the datasheet estimate and the measured rate.
+ * Once the host has opened the control interface the frames go there.
+ */
+static void
+spi_progress(progress_t *p, char op, uint32_t done, uint32_t total, uint32_t eta_ms)
+{
+    if (!spi_progress_due(p))
+    {
+        return;
+    }
+    const uint8_t ctrl = usb_ctrl_open();
+    const uint32_t now = timer_ticks();
+    progress_now = 0;
+    p->last = now;
+
+    const uint32_t elapsed = now - p->start;
+    const uint32_t bps = bytes_per_sec(done, elapsed / TIMER_TICKS_PER_MS);
+    const uint32_t left = total > done ? total - done : 0;
+    if (bps)
+    {
+        uint32_t measured = (left / bps) * 1000 + ((left % bps) * 1000) / bps;
+        if (measured > eta_ms)
+        {
+            eta_ms = measured;
+        }
+    }
+
+    char buf[4 + 5 * 9];
+    uint8_t off = 0;
+    buf[off++] = '#';
+    buf[off++] = 'P';
+    buf[off++] = op;
+    buf[off++] = ' ';
+    off += progress_hex(&buf[off], done);
+    off += progress_hex(&buf[off], total);
+    off += progress_hex(&buf[off], elapsed);
+    off += progress_hex(&buf[off], bps);
+    off += progress_hex(&buf[off], eta_ms);
+    buf[off - 1] = '\r';
+    buf[off++] = '\n';
+    if (ctrl)
+    {
+        usb_ctrl_write((uint8_t *)buf, off);
+    }
+    else
+    {
+        out_write((uint8_t *)buf, off);
+        out_flush();
+    }
+}
+
+/* start of the NVRAM variable that holds the firmware password */
+static const uint8_t pwd_pattern[] = { 0xFF, 0x23, 0x80, 0x4E };
+
+static void
+spi_locate_pwd_found(uint32_t offset)
+{
+    send_str(PSTR("Found potential password at address: "));
+    print_address(offset, 1);
+}
+
+/* locate NVRAM variable(s) that hold the firmware passowrd */
+static void
+spi_locate_pwd(void)
+{
+    uint32_t start_addr = 0;
+    const uint32_t end_addr = target_flash_size;
+    spi_erase_reading(start_addr, end_addr);
+
+    spi_power(1);
+    _delay_ms(2);
+    // read a page
+    spi_read_begin(start_addr);
+    spi_scan_reset();
+
+    uint32_t led_on = 1;
+    uint32_t led_count = 0;
+    /* turn LED on if it wasn't already */
+    out(0xD6, 1);
+    send_str(PSTR("Locating passwords...\r\n"));
+    progress_t progress;
+    spi_progress_begin(&progress, 0);
+    
+    while (1)
+    {
+        /* compare GUID while the data is shifted in */
+        spi_scan(256, pwd_pattern, 3, spi_locate_pwd_found);
+        spi_progress(&progress, 'L', start_addr + 256, end_addr, 0);
+        if (spi_cancelled())
+        {
+            break;
+        }
+        /* turn on/off led */
+        if (led_count == 0x50)
+        {
+            if (led_on == 0)
+            {
+                out(0xD6, 1);
+                led_on = 1;
+            }
+            else if (led_on == 1)
+            {
+                led_on = 0;
+                out(0xD6,0);
             }
+            led_count = 0;
         }
-        start_addr += sizeof(data);
+        led_count++;
+        start_addr += 256;
         if (start_addr >= end_addr)
         {
             break;
         }
     }
     send_str(PSTR("All done!\r\n"));
-    /* set clock signal high to end the operation */
-    spi_cs(0);
+    spi_read_end();
     spi_power(0);
 }
 
+static uint32_t pwd_addr[MAX_PWDS];
+static uint8_t pwd_count;
+
+static void
+spi_erase_pwd_found(uint32_t offset)
+{
+    /* we want to erase the whole sector so only store that address */
+    const uint32_t sector = offset & ~FLASH_SUBSECTOR_MASK;
+    if (pwd_count != 0 && pwd_addr[pwd_count - 1] == sector)
+    {
+        return;
+    }
+    /* ooops, flagged by going over the limit */
+    if (pwd_count <= MAX_PWDS)
+    {
+        if (pwd_count < MAX_PWDS)
+        {
+            pwd_addr[pwd_count] = sector;
+        }
+        pwd_count++;
+    }
+}
+
 /* locate and remove NVRAM variable(s) that hold the firmware passowrd */
 static void
 spi_erase_pwd(void)
 {
-    uint32_t pwd_addr[MAX_PWDS] = {0};
     if (MAX_PWDS > UINT8_MAX)
     {
         return;
@@ -613,19 +1902,15 @@ spi_erase_pwd(void)
     /* find password variables */
     /* we should expect only one hit, more are possible */
     uint32_t start_addr = 0;
-    const uint32_t end_addr = 8L << 20;
-    uint8_t pwd_count = 0;
+    const uint32_t end_addr = target_flash_size;
+    pwd_count = 0;
 
     /* read a page */
     spi_power(1);
     _delay_ms(2);
-    spi_cs(1);
-    spi_send(0x03);
-    /* command is followed by three address bytes */
-    spi_send(start_addr >> 16);
-    spi_send(start_addr >>  8);
-    spi_send(start_addr >>  0);
-    uint8_t data[256];
+    // read a page
+    spi_read_begin(start_addr);
+    spi_scan_reset();
     send_str(PSTR("Locating passwords...\r\n"));
     uint32_t led_on = 1;
     uint32_t led_count = 0;
@@ -634,9 +1919,11 @@ spi_erase_pwd(void)
 
     while (1)
     {
-        for (int i = 0 ; i < 256 ; i++)
+        /* compare GUID while the data is shifted in */
+        spi_scan(256, pwd_pattern, sizeof(pwd_pattern), spi_erase_pwd_found);
+        if (spi_cancelled())
         {
-            data[i] = spi_send(0);
+            break;
         }
         /* turn on/off led */
         if (led_count == 0x1000)
@@ -654,35 +1941,27 @@ spi_erase_pwd(void)
             led_count = 0;
         }
         led_count++;
-        /* compare GUID */
-        for (int i = 0; i < 255; i++)
-        {
-            if (data[i] == 0xFF && data[i+1] == 0x23)
-            {
-                if (i < 253 && // avoid reading off limits
-                    data[i+2] == 0x80 &&
-                    data[i+3] == 0x4E)
-                {
-                    /* we want to erase the whole sector so only store that address */
-                    pwd_addr[pwd_count++] = start_addr & ~FLASH_SUBSECTOR_MASK;
-                    /* ooops */
-                    if (pwd_count > MAX_PWDS)
-                    {
-                        return;
-                    }
-                }
-            }
-        }
-        start_addr += sizeof(data);
+        start_addr += 256;
         if (start_addr >= end_addr)
         {
             break;
         }
     }
 
-    /* set clock signal high to end the read */
-    spi_cs(0);
+    spi_read_end();
     spi_power(0);
+    /* a cancelled scan may have missed some, erase none */
+    if (spi_aborted)
+    {
+        return;
+    }
+
+    /* ooops */
+    if (pwd_count > MAX_PWDS)
+    {
+        spi_fail(PSTR("ERROR: too many password locations, nothing erased.\r\n"));
+        return;
+    }
     
     send_str(PSTR("Erasing passwords...\r\n"));
     /* finally erase the sectors we found */
@@ -692,103 +1971,562 @@ spi_erase_pwd(void)
         print_address(pwd_addr[i], 1);
         spi_write_enable();
         spi_erase_sector(pwd_addr[i]);
+        if (spi_cancelled())
+        {
+            return;
+        }
     }
     send_str(PSTR("All done!\r\n"));
 }
 
+/* CRC-16/XMODEM and CRC-32 of a flash range */
 static void
-spi_bulk_erase_S25FL128S(void)
+spi_hash(void)
 {
-    send_str(PSTR("Starting Spansion S25FL128S bulk erase...\r\n"));
+    uint32_t addr = usb_serial_readhex();
+    uint32_t len = usb_serial_readhex();
+    uint16_t crc16 = CRC16_INIT;
+    uint32_t crc32 = CRC32_INIT;
+    spi_erase_reading(addr, len);
 
-    spi_write_enable();
+    spi_power(1);
+    _delay_ms(2);
+    spi_read_begin(addr);
+    while (len)
+    {
+        uint16_t n = len < 0x8000 ? len : 0x8000;
+        spi_read_crc(n, &crc16, &crc32);
+        len -= n;
+        if (spi_cancelled())
+        {
+            break;
+        }
+    }
+    spi_read_end();
+    spi_power(0);
+    if (spi_aborted)
+    {
+        return;
+    }
 
-    spi_cs(1);
-    spi_send(0x60);
-    spi_cs(0);
-    while (spi_status() & SPI_WIP)
+    send_str(PSTR("CRC16 "));
+    print_address(crc16, 0);
+    send_str(PSTR(" CRC32 "));
+    print_address(CRC32_FINAL(crc32), 1);
+}
+
+/* compare a flash range against data streamed by the host */
+static void
+spi_verify(void)
+{
+    host_sending = 1;
+    uint32_t addr = usb_serial_readhex();
+    uint32_t len = usb_serial_readhex();
+    uint32_t mismatch = UINT32_MAX;
+    uint8_t * const buf = xmodem_block.data;
+    spi_erase_reading(addr, len);
+
+    send_str(PSTR("G\r\n"));
+    spi_power(1);
+    _delay_ms(2);
+    spi_read_begin(addr);
+
+    for (uint32_t offset = 0 ; offset < len ; )
     {
-        ;
+        uint16_t chunk = sizeof(xmodem_block.data);
+        if (len - offset < chunk)
+        {
+            chunk = len - offset;
+        }
+        out_flush();
+        if (usb_serial_read(buf, chunk, UPLOAD_TIMEOUT) != (int16_t)chunk)
+        {
+            spi_read_end();
+            spi_power(0);
+            spi_fail(PSTR("verify timeout\r\n"));
+            return;
+        }
+        /* keep draining the host data after the first difference */
+        if (mismatch == UINT32_MAX)
+        {
+            uint16_t diff = spi_read_diff(buf, chunk);
+            if (diff != chunk)
+            {
+                mismatch = addr + offset + diff;
+            }
+        }
+        offset += chunk;
+        if (spi_cancelled())
+        {
+            return;
+        }
     }
-    send_str(PSTR("\r\nFinished bulk erase!\r\n"));
+    spi_read_end();
     spi_power(0);
+
+    if (mismatch == UINT32_MAX)
+    {
+        send_str(PSTR("verify ok\r\n"));
+    }
+    else
+    {
+        spi_fail(PSTR("verify failed at: "));
+        print_address(mismatch, 1);
+    }
 }
 
 static void
-spi_bulk_erase_N25Q064A(void)
+spi_erase_sector(uint32_t addr)
 {
-    send_str(PSTR("Starting Micron N25Q064A/Winbond W25Q64FV bulk erase...\r\n"));
-    
-    spi_write_enable();
-    
+    if (spi_aborted)
+    {
+        return;
+    }
+	spi_cs(1);
+	spi_cmd_addr(0x20, addr);
+	spi_cs(0);
+
+	spi_wait_wip(spi_op_timeout(0x20));
+}
+
+static void
+spi_erase_block(uint32_t addr)
+{
+    if (spi_aborted)
+    {
+        return;
+    }
     spi_cs(1);
-    spi_send(0xC7);
+    spi_cmd_addr(0xD8, addr);
     spi_cs(0);
-    while (spi_status() & SPI_WIP)
+    
+    spi_wait_wip(spi_op_timeout(0xD8));
+}
+
+/* blocks spi_erase_range() found already erased */
+static uint16_t spi_erase_skipped;
+
+/* smallest erase unit of the chip, ranges must be aligned to it */
+static uint32_t
+spi_erase_mask(void)
+{
+    return (1UL << chip.sector_shift) - 1;
+}
+
+/* ms to read len bytes at the current SPI clock, 8 clocks of fosc/2
+ * to fosc/128 each; a blank check only pays off on units that take
+ * longer than this to erase
+ */
+static uint32_t
+spi_read_ms(uint32_t len)
+{
+    const uint32_t cycles = 16UL << spi_clock;
+    return (len / 1000 * cycles + len % 1000 * cycles / 1000) / (F_CPU / 1000000UL);
+}
+
+/* pick the erase that covers addr with the least expected time
+ * returns the opcode, or 0 if nothing fits
+ */
+static uint8_t
+spi_erase_pick(uint32_t addr, uint32_t left, uint32_t *size, uint16_t *ms)
+{
+    const uint8_t has4k = chip.flags & CHIP_ERASE_4K;
+    const uint8_t has32k = chip.flags & CHIP_ERASE_32K;
+
+    if ((chip.flags & CHIP_ERASE_64K) && (addr & 0xFFFF) == 0 && left >= 65536)
     {
-        send_str(PSTR("."));
+        uint32_t alt = has32k ? 2UL * chip.tbe32_typ : has4k ? 16UL * chip.tse_typ : UINT32_MAX;
+        if (chip.tbe64_typ <= alt)
+        {
+            *size = 65536;
+            *ms = chip.tbe64_typ;
+            return 0xD8;
+        }
     }
-    send_str(PSTR("\r\nFinished bulk erase!\r\n"));
-    spi_power(0);
+    if (has32k && (addr & 0x7FFF) == 0 && left >= 32768)
+    {
+        uint32_t alt = has4k ? 8UL * chip.tse_typ : UINT32_MAX;
+        if (chip.tbe32_typ <= alt)
+        {
+            *size = 32768;
+            *ms = chip.tbe32_typ;
+            return 0x52;
+        }
+    }
+    if (has4k && (addr & 0xFFF) == 0 && left >= 4096)
+    {
+        *size = 4096;
+        *ms = chip.tse_typ;
+        return 0x20;
+    }
+    return 0;
 }
 
-/* MX25L64 doesn't have bulk erase command but we can erase 64k sectors */
-static void
-spi_bulk_erase_MX25L64(void)
+/* walk [addr, addr+len) with the picked erases
+ * returns the expected time in ms, or UINT32_MAX if it can't be covered
+ */
+static uint32_t
+spi_erase_walk(uint32_t addr, uint32_t len, uint8_t doit)
 {
-    send_str(PSTR("Starting Macronix MX25L64 bulk erase...\r\n"));
+    uint32_t total = 0;
+    while (len)
+    {
+        uint32_t size;
+        uint16_t ms;
+        uint8_t op = spi_erase_pick(addr, len, &size, &ms);
+        if (op == 0)
+        {
+            return UINT32_MAX;
+        }
+        /* skip blank blocks when reading them is quicker than the erase */
+        if (doit && ms > spi_read_ms(size) && spi_blank_check(addr, size) == UINT32_MAX)
+        {
+            spi_erase_skipped++;
+        }
+        else if (doit)
+        {
+            if (spi_aborted)
+            {
+                break;
+            }
+            spi_write_enable();
+            spi_cs(1);
+            spi_cmd_addr(op, addr);
+            spi_cs(0);
+            spi_wait_wip(spi_op_timeout(op));
+        }
+        total += ms;
+        addr += size;
+        len -= size;
+    }
+    return total;
+}
 
-    uint32_t addr = 0;
-    /* 128 * 64k blocks */
-    for (int i = 0; i < 128; i++)
+/* a whole chip range is quicker with the bulk erase command */
+static uint8_t
+spi_erase_whole(uint32_t addr, uint32_t len)
+{
+    return chip.chip_erase_op && addr == 0 && len == target_flash_size
+        && chip.tce_typ < spi_erase_walk(addr, len, 0);
+}
+
+/* erase [addr, addr+len) using chip erase, 64k, 32k and 4k erases,
+ * whichever combination the chip timings say is fastest
+ * returns -1 if the range isn't aligned to the smallest erase unit
+ */
+static int8_t
+spi_erase_range(uint32_t addr, uint32_t len)
+{
+    if (((addr | len) & spi_erase_mask()) != 0 || addr + len > target_flash_size)
+    {
+        return -1;
+    }
+    spi_unprotect();
+    spi_erase_skipped = 0;
+    if (spi_erase_whole(addr, len))
     {
+        /* only read the chip first when that is quicker than tCE, a
+         * dirty one is found out at its first dirty byte
+         */
+        if (chip.tce_typ > spi_read_ms(len) && spi_blank_check(0, len) == UINT32_MAX)
+        {
+            return 0;
+        }
+        if (spi_aborted)
+        {
+            return -1;
+        }
         spi_write_enable();
         spi_cs(1);
-        spi_send(0xD8);
-        spi_send(addr >> 16);
-        spi_send(addr >>  8);
-        spi_send(addr >>  0);
+        spi_send(chip.chip_erase_op);
         spi_cs(0);
-        
-        while (spi_status() & SPI_WIP)
+        spi_wait_wip(spi_op_timeout(chip.chip_erase_op));
+        return 0;
+    }
+    if (spi_erase_walk(addr, len, 0) == UINT32_MAX)
+    {
+        return -1;
+    }
+    spi_erase_walk(addr, len, 1);
+    return 0;
+}
+
+static progress_t erase_progress;
+
+static uint8_t
+spi_erase_active(void)
+{
+    return erase_busy || erase_addr < erase_end;
+}
+
+/* erase progress counts whole blocks, the ETA comes from the planner */
+static void
+spi_erase_progress(void)
+{
+    /* the planner walks every remaining block, only for a real frame */
+    if (!spi_progress_due(&erase_progress))
+    {
+        return;
+    }
+    uint32_t eta;
+    if (erase_op)
+    {
+        uint32_t ms = (timer_ticks() - erase_start) / TIMER_TICKS_PER_MS;
+        eta = chip.tce_typ > ms ? chip.tce_typ - ms : 0;
+    }
+    else
+    {
+        eta = spi_erase_walk(erase_addr, erase_end - erase_addr, 0);
+    }
+    spi_progress(&erase_progress, 'E', erase_addr - erase_base, erase_end - erase_base, eta);
+}
+
+/* erase task step: finish the running erase or start the next block,
+ * never waits for WIP so commands are still seen in between
+ */
+static uint8_t
+spi_erase_task(void)
+{
+    if (erase_suspended)
+    {
+        return 1;
+    }
+    if (erase_busy)
+    {
+        if (spi_status() & SPI_WIP)
         {
-            ;
+            if (timer_ticks() - erase_issued > erase_limit * TIMER_TICKS_PER_MS)
+            {
+                spi_abort(PSTR("erase timeout\r\n"));
+                return 0;
+            }
+            if (spi_cancelled())
+            {
+                return 0;
+            }
+            spi_erase_progress();
+            return 1;
+        }
+        erase_busy = 0;
+        if (spi_fsr_failed())
+        {
+            return 0;
         }
-        addr += 65536;
     }
-    spi_power(0);
+    if (erase_addr >= erase_end)
+    {
+        send_str(PSTR("\r\nFinished erase in (ms): "));
+        print_address((timer_ticks() - erase_start) / TIMER_TICKS_PER_MS, 1);
+        send_str(PSTR("Blocks already blank: "));
+        print_address(spi_erase_skipped, 1);
+        /* the main loop's prompt is long gone, a script has none */
+        if (!script_active)
+        {
+            out_char('>');
+        }
+        spi_power(0);
+        return 0;
+    }
+
+    const uint32_t addr = erase_addr;
+    uint32_t size = erase_end - addr;
+    uint8_t op = erase_op;
+    if (op)
+    {
+        /* a whole chip erase is only issued once a dirty 64k chunk is
+         * found, the chip is blank checked one chunk per step; unless
+         * reading the whole chip would take longer than tCE
+         */
+        if (size > 65536)
+        {
+            size = 65536;
+        }
+        if (chip.tce_typ > spi_read_ms(erase_end - erase_base)
+            && spi_blank_check(addr, size) == UINT32_MAX)
+        {
+            erase_addr += size;
+            if (erase_addr >= erase_end)
+            {
+                spi_erase_skipped++;
+            }
+            spi_erase_progress();
+            return 1;
+        }
+        if (spi_aborted)
+        {
+            return 0;
+        }
+        erase_addr = erase_end;
+    }
+    else
+    {
+        uint16_t ms;
+        op = spi_erase_pick(addr, size, &size, &ms);
+        erase_block = addr;
+        erase_addr += size;
+        /* one block per step, blank or not */
+        if (ms > spi_read_ms(size) && spi_blank_check(addr, size) == UINT32_MAX)
+        {
+            spi_erase_skipped++;
+            spi_erase_progress();
+            return 1;
+        }
+        if (spi_aborted)
+        {
+            return 0;
+        }
+    }
+    spi_write_enable();
+    spi_cs(1);
+    if (erase_op)
+    {
+        spi_send(op);
+    }
+    else
+    {
+        spi_cmd_addr(op, addr);
+    }
+    spi_cs(0);
+    erase_busy = 1;
+    erase_issued = timer_ticks();
+    erase_limit = spi_op_timeout(op);
+    return 1;
 }
 
+/* get the bus back for a command, chip erase and chips without
+ * suspend finish the running erase first
+ */
 static void
-spi_erase_sector(uint32_t addr)
+spi_erase_suspend(void)
 {
-	spi_cs(1);
-	spi_send(0x20);
-	spi_send(addr >> 16);
-	spi_send(addr >>  8);
-	spi_send(addr >>  0);
-	spi_cs(0);
+    if (!erase_busy || erase_suspended)
+    {
+        return;
+    }
+    if (chip.suspend_op && !erase_op)
+    {
+        spi_cs(1);
+        spi_send(chip.suspend_op);
+        spi_cs(0);
+        spi_wait_wip(spi_op_timeout(chip.suspend_op));
+        erase_suspended = 1;
+        return;
+    }
+    spi_wait_wip(spi_op_timeout(erase_op ? erase_op : 0xD8));
+    erase_busy = 0;
+}
+
+static void
+spi_erase_resume(void)
+{
+    if (!erase_suspended)
+    {
+        return;
+    }
+    spi_cs(1);
+    spi_send(chip.resume_op);
+    spi_cs(0);
+    erase_suspended = 0;
+    erase_issued = timer_ticks();
+    /* let the erase make progress before it can be suspended again */
+    _delay_ms(1);
+}
+
+/* a suspended block reads back undefined data, so a read that overlaps
+ * [erase_block, erase_addr) lets that erase finish first, like chips
+ * without suspend do
+ */
+static void
+spi_erase_reading(uint32_t addr, uint32_t len)
+{
+    if (!erase_suspended || addr >= erase_addr || addr + len <= erase_block)
+    {
+        return;
+    }
+    spi_erase_resume();
+    spi_wait_wip(erase_limit);
+    erase_busy = 0;
+}
 
-	while (spi_status() & SPI_WIP)
+/* queue an erase of [addr, addr+len), with op as a whole chip command
+ * or by the planner when op is 0
+ */
+static void
+spi_erase_queue(uint32_t addr, uint32_t len, uint8_t op)
+{
+    if (((addr | len) & spi_erase_mask()) != 0 || addr + len > target_flash_size
+        || (!op && spi_erase_walk(addr, len, 0) == UINT32_MAX))
     {
-		;
+        spi_fail(PSTR("range must be aligned to the erase size: "));
+        print_address(spi_erase_mask() + 1, 1);
+        return;
     }
+    spi_power(1);
+    _delay_ms(2);
+    spi_unprotect();
+    spi_erase_skipped = 0;
+    erase_addr = addr;
+    erase_base = addr;
+    erase_end = addr + len;
+    erase_op = op;
+    erase_start = timer_ticks();
+    spi_progress_begin(&erase_progress, 0);
+    task_start(spi_erase_task);
+    send_str(PSTR("erase queued\r\n"));
+}
+
+/* P addr len: erase a range with the planner */
+static void
+spi_erase_range_interactive(void)
+{
+    uint32_t addr = usb_serial_readhex();
+    uint32_t len = usb_serial_readhex();
+
+    spi_erase_queue(addr, len, spi_erase_whole(addr, len) ? chip.chip_erase_op : 0);
+}
+
+/* C: erase the whole chip the fastest way the chip database allows */
+static void
+spi_chip_erase(void)
+{
+    send_str(PSTR("Starting "));
+    out_write(chip.name, strnlen(chip.name, CHIP_NAME_LEN));
+    send_str(PSTR(" chip erase...\r\n"));
+    spi_erase_queue(0, target_flash_size, chip.chip_erase_op);
+}
+
+/* commands that only read and can run while an erase is suspended,
+ * i and m write the configuration and status registers so they queue
+ */
+static uint8_t
+spi_cmd_allows(int c)
+{
+    return c == XMODEM_NAK || c == XMODEM_CAN || (c > 0 && strchr_P(PSTR("rRadHvKlshGcxTV"), c) != NULL);
 }
 
+/* K addr len: report the first address that isn't erased */
 static void
-spi_erase_block(uint32_t addr)
+spi_blank_check_interactive(void)
 {
-    spi_cs(1);
-    spi_send(0xD8);
-    spi_send(addr >> 16);
-    spi_send(addr >>  8);
-    spi_send(addr >>  0);
-    spi_cs(0);
-    
-    while (spi_status() & SPI_WIP)
+    uint32_t addr = usb_serial_readhex();
+    uint32_t len = usb_serial_readhex();
+    spi_erase_reading(addr, len);
+
+    spi_power(1);
+    _delay_ms(2);
+    uint32_t dirty = spi_blank_check(addr, len);
+    spi_power(0);
+    if (spi_aborted)
     {
-        ;
+        return;
+    }
+    if (dirty == UINT32_MAX)
+    {
+        send_str(PSTR("blank\r\n"));
+        return;
     }
+    spi_fail(PSTR("dirty at "));
+    print_address(dirty, 1);
 }
 
 static void
@@ -807,6 +2545,7 @@ spi_erase_sector_interactive(void)
 	char buf[16];
 	uint8_t off = 0;
 	buf[off++] = 'E';
+	buf[off++] = hexdigit(addr >> 24);
 	buf[off++] = hexdigit(addr >> 20);
 	buf[off++] = hexdigit(addr >> 16);
 	buf[off++] = hexdigit(addr >> 12);
@@ -816,22 +2555,14 @@ spi_erase_sector_interactive(void)
 	buf[off++] = '\r';
 	buf[off++] = '\n';
 
-	usb_serial_write(buf, off);
+	out_write(buf, off);
 }
 	
 static void
 spi_erase_8mb(void)
 {
-    uint32_t addr = 0;
-    for (int i = 0; i < 2048; i++)
-    {
-        spi_write_enable();
-        spi_erase_sector(addr);
-        addr += 4096;
-    }
-    char buf[16] = "done!\r\n";
-    
-    usb_serial_write(buf, 8);
+    uint8_t whole = spi_erase_whole(0, target_flash_size);
+    spi_erase_queue(0, target_flash_size, whole ? chip.chip_erase_op : 0);
 }
 
 static void
@@ -843,6 +2574,10 @@ spi_erase_16mb(void)
     {
         spi_write_enable();
         spi_erase_sector(addr);
+        if (spi_aborted)
+        {
+            return;
+        }
         addr += 65536;
     }
     send_str(PSTR("Finished total erase!\r\n"));
@@ -856,11 +2591,15 @@ spi_zap_8mb(void)
     {
         spi_write_enable();
         spi_erase_block(addr);
+        if (spi_aborted)
+        {
+            return;
+        }
         addr += 65536;
     }
     char buf[16] = "done!\r\n";
     
-    usb_serial_write(buf, 8);
+    out_write(buf, 8);
 }
 
 /* read user defined number of bytes from user defined address */
@@ -869,46 +2608,31 @@ spi_read_size(void)
 {
     uint32_t addr = usb_serial_readhex();
     uint32_t len = usb_serial_readhex();
+    if (len > INT32_MAX)
+    {
+        return;
+    }
+    spi_erase_reading(addr, len);
+
     spi_power(1);
     _delay_ms(2);
-    spi_cs(1);
-
-    // read a page
-    spi_send(0x03);
-    /* command is followed by three address bytes */
-    spi_send(addr >> 16);
-    spi_send(addr >>  8);
-    spi_send(addr >>  0);
+    spi_read_begin(addr);
 
     uint8_t data[16];
 
-    if (len > INT32_MAX)
-    {
-        return;
-    }
     int x = (int)len;
     while (x > 0)
     {
         int read_size = (x < 16) ? x : 16;
-        for (int i = 0 ; i < read_size ; i++)
-        {
-            data[i] = spi_send(0);
-        }
-        char buf[16*3+2];
-        uint8_t off = 0;
-        for (int i = 0 ; i < read_size ; i++)
+        spi_read_block(data, read_size);
+        out_hexdump(data, read_size);
+        x -= read_size;
+        if (spi_cancelled())
         {
-            buf[off++] = hexdigit(data[i] >> 4);
-            buf[off++] = hexdigit(data[i] >> 0);
-            buf[off++] = ' ';
+            break;
         }
-        buf[off++] = '\r';
-        buf[off++] = '\n';
-        
-        usb_serial_write(buf, off);
-        x -= read_size;
     }
-    spi_cs(0);
+    spi_read_end();
     spi_power(0);
 }
 
@@ -919,45 +2643,56 @@ spi_read(void)
      * user must input address and press enter
      */
 	uint32_t addr = usb_serial_readhex();
+	spi_erase_reading(addr, 16);
 
 	spi_power(1);
 	_delay_ms(2);
 
-	spi_cs(1);
-	//_delay_ms(1);
-
 	// read a page
-	spi_send(0x03);
-    /* command is followed by three address bytes */
-	spi_send(addr >> 16);
-	spi_send(addr >>  8);
-	spi_send(addr >>  0);
+	spi_read_begin(addr);
 
 	uint8_t data[16];
     /* we can keep reading till the end until we drive the clock HIGH
      * because the address auto increments after data is shifted
      * so in this case we read 16 bytes and stop
      */
-	for (int i = 0 ; i < 16 ; i++)
-    {
-		data[i] = spi_send(0);
-    }
+	spi_read_block(data, sizeof(data));
     
-	spi_cs(0);
+	spi_read_end();
 	spi_power(0);
 
-	char buf[16*3+2];
-	uint8_t off = 0;
-	for (int i = 0 ; i < 16 ; i++)
-	{
-		buf[off++] = hexdigit(data[i] >> 4);
-		buf[off++] = hexdigit(data[i] >> 0);
-		buf[off++] = ' ';
-	}
-	buf[off++] = '\r';
-	buf[off++] = '\n';
+	out_hexdump(data, sizeof(data));
+}
 
-	usb_serial_write(buf, off);
+/* read user defined number of bytes as Ascii85 text,
+ * 80 characters per 64 byte line
+ */
+static void
+spi_read_base85(void)
+{
+    uint32_t addr = usb_serial_readhex();
+    uint32_t len = usb_serial_readhex();
+    spi_erase_reading(addr, len);
+
+    spi_power(1);
+    _delay_ms(2);
+    spi_read_begin(addr);
+
+    uint8_t data[64];
+    while (len)
+    {
+        uint8_t read_size = (len < sizeof(data)) ? len : sizeof(data);
+        spi_read_block(data, read_size);
+        out_base85(data, read_size);
+        send_str(PSTR("\r\n"));
+        len -= read_size;
+        if (spi_cancelled())
+        {
+            break;
+        }
+    }
+    spi_read_end();
+    spi_power(0);
 }
 
 
@@ -965,42 +2700,76 @@ spi_read(void)
 static void
 spi_dump(void)
 {
-	const uint32_t end_addr = 8L << 20;
+	const uint32_t end_addr = target_flash_size;
+	spi_erase_reading(0, end_addr);
 
 	spi_power(1);
 	_delay_ms(1);
 
 	uint32_t addr = 0;
 	uint8_t buf[64];
+	int8_t unstable = 0;
+	progress_t progress;
+	spi_progress_begin(&progress, 1);
+	out_flush();
+	usb_serial_stream_begin();
 
-    spi_cs(1);
-    /* set the initial address for the read */
-    spi_send(0x03);
-    spi_send(addr >> 16);
-    spi_send(addr >>  8);
-    spi_send(addr >>  0);
+    if (integrity_mode)
+    {
+        integrity_reset();
+    }
+    else
+    {
+        /* set the initial address for the read */
+        spi_read_begin(addr);
+    }
 
 	while (1)
 	{
         /* read in 64 bytes increments */
         /* XXX: we can probably buffer more than that */
-		for (uint8_t off = 0 ; off < sizeof(buf) ; off++)
+        if (integrity_mode)
         {
-			buf[off] = spi_send(0);
+            /* never send a block two reads didn't agree on */
+            unstable = spi_read_verified(addr, buf, sizeof(buf));
+            if (unstable < 0)
+            {
+                break;
+            }
+        }
+        else
+        {
+            spi_read_block(buf, sizeof(buf));
         }
         
         /* send data to serial */
-		usb_serial_write(buf, sizeof(buf));
+		if (usb_serial_stream_write(buf, sizeof(buf)) < 0)
+        {
+            break;
+        }
         /* verify if we reach the end */
 		addr += sizeof(buf);
+		spi_progress(&progress, 'D', addr, end_addr, 0);
+		if ((addr & 0xFFF) == 0 && spi_cancelled())
+        {
+            break;
+        }
 		if (addr >= end_addr)
         {
 			break;
         }
 	}
-    /* set clock signal high to end the operation */
-    spi_cs(0);
+    if (!integrity_mode)
+    {
+        spi_read_end();
+    }
+	usb_serial_stream_end();
 	spi_power(0);
+    if (unstable < 0)
+    {
+        spi_fail(PSTR("\r\nreads never agreed at "));
+        print_address(addr, 1);
+    }
 }
 
 /* dump the rom via xmodem */
@@ -1009,102 +2778,388 @@ prom_send(void)
 {
 	// We have already received the first nak.
 	// Fire it up!
+	host_sending = 1;
+	out_flush();
 	if (xmodem_init(&xmodem_block, 1) < 0)
     {
-		return;
+		return;
+    }
+    
+    uint32_t end_addr = target_flash_size;
+	spi_erase_reading(0, end_addr);
+
+	spi_power(1);
+	_delay_ms(1);
+
+	uint32_t addr = 0;
+	uint32_t led_on = 1;
+	uint32_t led_count = 0;
+	/* turn LED on if it wasn't already */
+	out(0xD6, 1);
+	progress_t progress;
+	spi_progress_begin(&progress, 1);
+
+    if (integrity_mode)
+    {
+        integrity_reset();
+    }
+    else
+    {
+        spi_read_begin(addr);
+    }
+
+	while (1)
+	{
+        if (integrity_mode)
+        {
+            if (spi_read_verified(addr, xmodem_block.data, sizeof(xmodem_block.data)) < 0)
+            {
+                /* never send a block two reads didn't agree on */
+                xmodem_cancel();
+                out(0xD6, 0);
+                spi_power(0);
+                spi_fail(PSTR("reads never agreed at "));
+                print_address(addr, 1);
+                return;
+            }
+            xmodem_block.cksum = 0;
+            for (uint8_t i = 0; i < sizeof(xmodem_block.data); i++)
+            {
+                xmodem_block.cksum += xmodem_block.data[i];
+            }
+        }
+        else
+        {
+            /* checksum is computed while the data shifts in */
+            xmodem_block.cksum = spi_read_cksum(xmodem_block.data, sizeof(xmodem_block.data));
+        }
+
+		if (xmodem_send_block(&xmodem_block, 1) < 0)
+        {
+            if (!integrity_mode)
+            {
+                spi_read_end();
+            }
+			return;
+        }
+        
+		addr += sizeof(xmodem_block.data);
+		spi_progress(&progress, 'X', addr, end_addr, 0);
+        /* the host is still in the transfer, end it before saying why */
+        if (spi_cancel_poll())
+        {
+            xmodem_cancel();
+            out(0xD6, 0);
+            spi_cancelled();
+            return;
+        }
+		if (addr >= end_addr)
+		{
+			out(0xD6, 0);
+			break;
+        }
+        /* turn on/off led */
+        if (led_count == 0x50)
+        {
+            if (led_on == 0)
+            {
+                out(0xD6, 1);
+                led_on = 1;
+            }
+            else if (led_on == 1)
+            {
+                led_on = 0;
+                out(0xD6,0);
+            }
+            led_count = 0;
+        }
+        led_count++;
+	}
+
+    if (!integrity_mode)
+    {
+        spi_read_end();
+    }
+	spi_power(0);
+
+	xmodem_fini(&xmodem_block);
+}
+
+/* copy len bytes from src to dst (already erased) through the xmodem buffer,
+ * bytes that fall in [paddr, paddr+plen) are replaced with patch
+ */
+static void
+spi_copy(uint32_t src, uint32_t dst, uint32_t len, uint32_t paddr, const uint8_t *patch, uint8_t plen)
+{
+    uint8_t * const buf = xmodem_block.data;
+    while (len)
+    {
+        uint16_t n = len > sizeof(xmodem_block.data) ? sizeof(xmodem_block.data) : len;
+        spi_read_begin(src);
+        spi_read_block(buf, n);
+        spi_read_end();
+        for (uint16_t i = 0; i < n; i++)
+        {
+            if (dst + i - paddr < plen)
+            {
+                buf[i] = patch[dst + i - paddr];
+            }
+        }
+        spi_program(dst, buf, n);
+        src += n;
+        dst += n;
+        len -= n;
+    }
+}
+
+/* read the patched bytes back, r if they made it or -2 if not */
+static int8_t
+spi_patch_check(uint32_t addr, const uint8_t *data, uint8_t len, int8_t r)
+{
+    if (spi_aborted)
+    {
+        return -1;
+    }
+    spi_read_begin(addr);
+    const uint16_t diff = spi_read_diff(data, len);
+    spi_read_end();
+    return diff == len ? r : -2;
+}
+
+/* write len bytes at addr, len <= PATCH_MAX and inside one sector
+ * programs in place if the change only clears bits, otherwise the sector
+ * is rewritten through the scratch sector
+ * returns 0 in place, 1 rewritten, -1 if it can't be done, -2 if the
+ * bytes didn't read back
+ */
+static int8_t
+spi_patch(uint32_t addr, const uint8_t *data, uint8_t len)
+{
+    const uint32_t mask = spi_erase_mask();
+    const uint32_t sector = addr & ~mask;
+    if (len == 0 || len > PATCH_MAX || ((addr + len - 1) & ~mask) != sector
+        || addr + len > target_flash_size)
+    {
+        return -1;
+    }
+
+    spi_power(1);
+    _delay_ms(2);
+    spi_unprotect();
+
+    uint8_t * const old = xmodem_block.data;
+    spi_read_begin(addr);
+    spi_read_block(old, len);
+    spi_read_end();
+
+    uint8_t clears_only = 1;
+    for (uint8_t i = 0; i < len; i++)
+    {
+        if ((data[i] & old[i]) != data[i])
+        {
+            clears_only = 0;
+        }
+    }
+    if (clears_only)
+    {
+        spi_program(addr, data, len);
+        return spi_patch_check(addr, data, len, 0);
+    }
+
+    if (patch_scratch == UINT32_MAX || patch_scratch == sector)
+    {
+        return -1;
+    }
+    /* sector -> scratch, erase, scratch + patch -> sector; the sector
+     * is only erased once its copy made it to the scratch sector
+     */
+    if (spi_erase_range(patch_scratch, mask + 1) < 0 || spi_aborted)
+    {
+        return -1;
+    }
+    spi_copy(sector, patch_scratch, mask + 1, 0, NULL, 0);
+    if (spi_aborted || spi_erase_range(sector, mask + 1) < 0 || spi_aborted)
+    {
+        return -1;
+    }
+    spi_copy(patch_scratch, sector, mask + 1, addr, data, len);
+    return spi_patch_check(addr, data, len, 1);
+}
+
+/* p addr len b0 b1 ...: patch bytes, given in hex */
+static void
+spi_patch_interactive(void)
+{
+    uint32_t addr = usb_serial_readhex();
+    uint32_t len = usb_serial_readhex();
+    uint8_t data[PATCH_MAX];
+
+    if (len > PATCH_MAX)
+    {
+        spi_fail(PSTR("patch too long\r\n"));
+        return;
+    }
+    for (uint8_t i = 0; i < len; i++)
+    {
+        data[i] = usb_serial_readhex();
+    }
+
+    int8_t r = spi_patch(addr, data, len);
+    spi_power(0);
+    if (r == -2)
+    {
+        spi_fail(PSTR("patch failed, the bytes didn't read back\r\n"));
+    }
+    else if (r < 0)
+    {
+        if (!spi_aborted)
+        {
+            spi_fail(PSTR("patch failed, it must stay in one sector and needs a scratch sector (o)\r\n"));
+        }
+    }
+    else if (r == 0)
+    {
+        send_str(PSTR("patched in place\r\n"));
+    }
+    else
+    {
+        send_str(PSTR("patched through scratch sector\r\n"));
+    }
+}
+
+/* o addr: spare sector used by patches that need an erase */
+static void
+spi_set_scratch(void)
+{
+    uint32_t addr = usb_serial_readhex();
+    if ((addr & spi_erase_mask()) != 0 || addr >= target_flash_size)
+    {
+        spi_fail(PSTR("scratch must be sector aligned and inside the flash\r\n"));
+        return;
+    }
+    patch_scratch = addr;
+    send_str(PSTR("Scratch sector: "));
+    print_address(patch_scratch, 1);
+}
+
+/* clear the NVRAM byte at 0x6D8028 */
+static void
+spi_resetnvram(void)
+{
+    const uint8_t zero = 0x00;
+    if (spi_patch(0x6D8028, &zero, 1) < 0)
+    {
+        spi_fail(PSTR("failed!\r\n"));
+        return;
     }
-    
-    uint32_t end_addr = target_flash_size;
+    spi_power(0);
+    send_str(PSTR("done!\r\n"));
+}
 
-	spi_power(1);
-	_delay_ms(1);
+/* upload state, the data channel belongs to the upload until it ends */
+static uint32_t upload_addr;    // where the next chunk is programmed
+static uint32_t upload_len;     // bytes of the running upload, 0 if none
+static uint16_t upload_fill;    // bytes of the next chunk received so far
+static uint32_t upload_seen;    // timer_ticks() when data last came in
+static uint8_t upload_blink;    // chunks since the LED last toggled
+static uint8_t upload_led;
+static progress_t upload_progress;
 
-	uint32_t addr = 0;
-	uint32_t led_on = 1;
-	uint32_t led_count = 0;
-	/* turn LED on if it wasn't already */
-	out(0xD6, 1);
+static uint8_t
+spi_upload_end(void)
+{
+    upload_len = 0;
+    host_sending = 0;
+    return 0;
+}
 
-    spi_cs(1);
-    spi_send(0x03); // read
-    spi_send(addr >> 16);
-    spi_send(addr >>  8);
-    spi_send(addr >>  0);
+/* one step of an upload: take what the host has sent of the next chunk,
+ * waiting at most a frame for it, and program the chunk once complete
+ */
+static uint8_t
+spi_upload_task(void)
+{
+    const uint16_t chunk_size = sizeof(xmodem_block.data);
+    uint8_t * const buf = xmodem_block.data;
 
-	while (1)
-	{
-		for (uint8_t off = 0 ; off < sizeof(xmodem_block.data) ; off++)
-        {
-			xmodem_block.data[off] = spi_send(0);
-        }
+    out_flush();
+    const int16_t n = usb_serial_read(buf + upload_fill, chunk_size - upload_fill, 1);
+    if (n > 0)
+    {
+        upload_fill += n;
+        upload_seen = timer_ticks();
+    }
+    else if (n < 0 || timer_ticks() - upload_seen > (uint32_t)UPLOAD_TIMEOUT * TIMER_TICKS_PER_MS)
+    {
+        spi_fail(PSTR("upload timeout\r\n"));
+        return spi_upload_end();
+    }
+    if (upload_fill < chunk_size)
+    {
+        return spi_cancelled() ? spi_upload_end() : 1;
+    }
 
-		if (xmodem_send(&xmodem_block, 1) < 0)
-        {
-			return;
-        }
-        
-		addr += sizeof(xmodem_block.data);
-		if (addr >= end_addr)
-		{
-			out(0xD6, 0);
-			break;
-        }
-        /* turn on/off led */
-        if (led_count == 0x50)
-        {
-            if (led_on == 0)
-            {
-                out(0xD6, 1);
-                led_on = 1;
-            }
-            else if (led_on == 1)
-            {
-                led_on = 0;
-                out(0xD6,0);
-            }
-            led_count = 0;
-        }
-        led_count++;
-	}
+    upload_fill = 0;
+    spi_program(upload_addr, buf, chunk_size);
+    if (spi_cancelled())
+    {
+        return spi_upload_end();
+    }
+    upload_addr += chunk_size;
+    bytes_uploaded += chunk_size;
+    spi_progress(&upload_progress, 'U', bytes_uploaded, upload_len, spi_program_eta(upload_len - bytes_uploaded));
 
-    spi_cs(0);
-	spi_power(0);
+    /* turn on/off led */
+    if (++upload_blink == 0x50)
+    {
+        upload_led = !upload_led;
+        out(0xD6, upload_led);
+        upload_blink = 0;
+    }
 
-	xmodem_fini(&xmodem_block);
+    if (bytes_uploaded < upload_len)
+    {
+        return 1;
+    }
+    send_str(PSTR("done!\r\n"));
+    return spi_upload_end();
 }
 
+/* hand the data the host sends after the G line to the upload task,
+ * the main loop won't read commands again until it ends
+ */
 static void
-spi_resetnvram(void)
+spi_upload_start(uint32_t addr, uint32_t len)
 {
-    uint32_t addr = 0x6D8028;
-    spi_write_enable();
-    spi_cs(1);
-    /* page program command */
-    spi_send(0x02);
-    spi_send(addr >> 16);
-    spi_send(addr >>  8);
-    spi_send(addr >>  0);
-    spi_send(0x00);
-    spi_cs(0);
-    
-    // wait for write to finish
-    while (spi_status() & SPI_WIP)
+    if (len == 0)
     {
-        ;
+        send_str(PSTR("done!\r\n"));
+        return;
     }
-    send_str(PSTR("done!\r\n"));
+    upload_addr = addr;
+    upload_len = len;
+    upload_fill = 0;
+    upload_seen = timer_ticks();
+    upload_blink = 0;
+    upload_led = 1;
+    spi_progress_begin(&upload_progress, 0);
+    task_start(spi_upload_task);
 }
 
 /** Write some number of pages into the PROM. */
 static void
 spi_upload(void)
 {
+    host_sending = 1;
     bytes_uploaded = 0;
 	uint32_t addr = usb_serial_readhex();
 	uint32_t len = usb_serial_readhex();
 
-	// addr and len must be 4k aligned
-	const int fail = ((len & SPI_PAGE_MASK) != 0) || ((addr & SPI_PAGE_MASK) != 0);
+	/* addr and len must be 4k aligned, and the range is erased up front
+	 * through the erase planner
+	 */
+	const int fail = ((len & SPI_PAGE_MASK) != 0) || ((addr & SPI_PAGE_MASK) != 0)
+		|| spi_erase_range(addr, len) < 0 || spi_aborted;
 
 	char outbuf[32];
 	uint8_t off = 0;
@@ -1129,100 +3184,35 @@ spi_upload(void)
 	outbuf[off++] = '\r';
 	outbuf[off++] = '\n';
 
-	usb_serial_write(outbuf, off);
+	out_write(outbuf, off);
 	if (fail)
     {
+        cmd_failed = 1;
 		return;
     }
 
-    uint32_t led_on = 1;
-    uint32_t led_count = 0;
     /* turn LED on if it wasn't already */
     out(0xD6, 1);
 
-	uint32_t offset = 0;
-	const size_t chunk_size = sizeof(xmodem_block.data);
-	uint8_t * const buf = xmodem_block.data;
-
-	for (offset = 0 ; offset < len ; offset += chunk_size)
-	{
-		// read 128 bytes into the xmodem data block
-		for (uint8_t i = 0 ; i < chunk_size; i++)
-		{
-			int c;
-			while ((c = usb_serial_getchar()) == -1)
-            {
-				;
-            }
-			buf[i] = c;
-		}
-#if 0
-		if ((addr & SPI_PAGE_MASK) == 0)
-		{
-			// new sector; erase this one
-			spi_write_enable();
-			spi_erase_sector(addr);
-		}
-#endif
-		spi_write_enable();
-		uint8_t r2 = spi_status();
-
-		spi_cs(1);
-        /* page program command */
-		spi_send(0x02);
-		spi_send(addr >> 16);
-		spi_send(addr >>  8);
-		spi_send(addr >>  0);
-			
-		for (uint8_t i = 0 ; i < chunk_size ; i++)
-        {
-			spi_send(buf[i]);
-            bytes_uploaded++;
-        }
-
-        /* turn on/off led */
-        if (led_count == 0x50)
-        {
-            if (led_on == 0)
-            {
-                out(0xD6, 1);
-                led_on = 1;
-            }
-            else if (led_on == 1)
-            {
-                led_on = 0;
-                out(0xD6,0);
-            }
-            led_count = 0;
-        }
-        led_count++;
-
-		spi_cs(0);
-
-		// wait for write to finish
-		while (spi_status() & SPI_WIP)
-        {
-			;
-        }
-
-		//usb_serial_putchar('.');
-		addr += chunk_size;
-	}
-
-	send_str(PSTR("done!\r\n"));
+	spi_unprotect();
+	spi_upload_start(addr, len);
 }
 
 /** Write only bios pages into the PROM. */
 static void
 spi_biosupload(void)
 {
+    host_sending = 1;
     bytes_uploaded = 0;
     /* bios starts at 0x190000 */
     uint32_t addr = 0x190000;
     uint32_t len = 0x670000;
     
-    // addr and len must be 4k aligned
-    const int fail = ((len & SPI_PAGE_MASK) != 0) || ((addr & SPI_PAGE_MASK) != 0);
+    /* erase everything up front with the largest units that fit, before
+     * the host is told to go ahead; the range must be aligned to the
+     * smallest erase and inside the flash
+     */
+    const int fail = spi_erase_range(addr, len) < 0 || spi_aborted;
     
     char outbuf[32];
     uint8_t off = 0;
@@ -1245,96 +3235,31 @@ spi_biosupload(void)
     outbuf[off++] = '\r';
     outbuf[off++] = '\n';
     
-    usb_serial_write(outbuf, off);
+    out_write(outbuf, off);
     if (fail)
     {
+        cmd_failed = 1;
         return;
     }
     
-    uint32_t led_on = 1;
-    uint32_t led_count = 0;
     /* turn LED on if it wasn't already */
     out(0xD6, 1);
     
-    uint32_t offset = 0;
-    const size_t chunk_size = sizeof(xmodem_block.data);
-    uint8_t * const buf = xmodem_block.data;
-    
-    for (offset = 0 ; offset < len ; offset += chunk_size)
-    {
-        // read 128 bytes into the xmodem data block
-        for (uint8_t i = 0 ; i < chunk_size; i++)
-        {
-            int c;
-            while ((c = usb_serial_getchar()) == -1)
-            {
-                ;
-            }
-            buf[i] = c;
-        }
-        
-        if ((addr & SPI_PAGE_MASK) == 0)
-        {
-            // new sector; erase this one
-            spi_write_enable();
-            spi_erase_sector(addr);
-        }
-        
-        spi_write_enable();
-        uint8_t r2 = spi_status();
-        
-        spi_cs(1);
-        /* page program command */
-        spi_send(0x02);
-        spi_send(addr >> 16);
-        spi_send(addr >>  8);
-        spi_send(addr >>  0);
-        
-        for (uint8_t i = 0 ; i < chunk_size ; i++)
-        {
-            spi_send(buf[i]);
-            bytes_uploaded++;
-        }
-        
-        /* turn on/off led */
-        if (led_count == 0x50)
-        {
-            if (led_on == 0)
-            {
-                out(0xD6, 1);
-                led_on = 1;
-            }
-            else if (led_on == 1)
-            {
-                led_on = 0;
-                out(0xD6,0);
-            }
-            led_count = 0;
-        }
-        led_count++;
-        
-        spi_cs(0);
-        
-        // wait for write to finish
-        while (spi_status() & SPI_WIP)
-        {
-            ;
-        }
-        
-        addr += chunk_size;
-    }
-    
-    send_str(PSTR("done!\r\n"));
+    spi_upload_start(addr, len);
 }
 
 /* generic function to flash input bios area */
 static void
 spi_flasharea(uint32_t addr, uint32_t len)
 {
+    host_sending = 1;
     bytes_uploaded = 0;
     
-    // addr and len must be 4k aligned
-    const int fail = ((len & SPI_PAGE_MASK) != 0) || ((addr & SPI_PAGE_MASK) != 0);
+    /* erase everything up front with the largest units that fit, before
+     * the host is told to go ahead; the range must be aligned to the
+     * smallest erase and inside the flash
+     */
+    const int fail = spi_erase_range(addr, len) < 0 || spi_aborted;
     
     char outbuf[32];
     uint8_t off = 0;
@@ -1357,109 +3282,307 @@ spi_flasharea(uint32_t addr, uint32_t len)
     outbuf[off++] = '\r';
     outbuf[off++] = '\n';
     
-    usb_serial_write(outbuf, off);
+    out_write(outbuf, off);
     if (fail)
     {
+        cmd_failed = 1;
+        return;
+    }
+    
+    /* turn LED on if it wasn't already */
+    out(0xD6, 1);
+    
+    spi_upload_start(addr, len);
+}
+
+static void
+spi_stats(void)
+{
+    send_str(PSTR("Uploaded and written bytes: "));
+    print_address(bytes_uploaded, 1);
+    send_str(PSTR("Last program/erase wait (us): "));
+    print_address(spi_wait_ticks * TIMER_US_PER_TICK, 1);
+    if (spi_erase_active())
+    {
+        send_str(PSTR("Erasing at: "));
+        print_address(erase_addr, 1);
+        send_str(PSTR("Erase end: "));
+        print_address(erase_end, 1);
+    }
+}
+
+static void
+spi_integrity_report(void)
+{
+    send_str(PSTR("Current SPI clock: "));
+    print_address(spi_clock, 1);
+    send_str(PSTR("Unrecoverable blocks: "));
+    print_address(integrity_failed, 1);
+    for (uint8_t i = 0; i < INTEGRITY_REGIONS; i++)
+    {
+        if (integrity_errors[i] == 0)
+        {
+            continue;
+        }
+        send_str(PSTR("Region "));
+        print_address((uint32_t)i << INTEGRITY_REGION_SHIFT, 0);
+        send_str(PSTR(" errors "));
+        print_address(integrity_errors[i], 0);
+        send_str(PSTR(" retries "));
+        print_address(integrity_retries[i], 1);
+    }
+}
+
+static void
+spi_change_integrity_mode(void)
+{
+    send_menu(PSTR("Dual-read integrity mode:\r\n"));
+    send_menu(PSTR("0 - off\r\n"));
+    send_menu(PSTR("1 - on\r\n"));
+    send_menu(PSTR("2 - show last dump report\r\n"));
+    uint32_t mode = usb_serial_readhex();
+
+    switch (mode) {
+        case 0:
+        case 1:
+            integrity_mode = mode;
+            spi_set_clock(spi_clock_base);
+            break;
+        case 2:
+            spi_integrity_report();
+            break;
+        default:
+            spi_fail(PSTR("ERROR: Invalid option selected.\r\n"));
+            break;
+    }
+}
+
+/* measured times of one operation type, in us */
+typedef struct
+{
+    uint32_t min;
+    uint32_t max;
+    uint32_t sum;
+    uint8_t n;
+    uint8_t hist[BENCH_BINS];
+} bench_t;
+
+static void
+bench_add(bench_t *b, uint32_t us)
+{
+    if (b->n == 0 || us < b->min)
+    {
+        b->min = us;
+    }
+    if (us > b->max)
+    {
+        b->max = us;
+    }
+    b->sum += us;
+    b->n++;
+    /* <256us, <1ms, <4ms ... <1s, >=1s */
+    uint8_t bin = 0;
+    for (uint32_t limit = 256; us >= limit && bin < BENCH_BINS - 1; limit <<= 2)
+    {
+        bin++;
+    }
+    b->hist[bin]++;
+}
+
+static uint32_t
+bench_avg(const bench_t *b)
+{
+    return b->n ? b->sum / b->n : 0;
+}
+
+static void
+bench_print(const bench_t *b, PGM_P name)
+{
+    send_str(name);
+    if (b->n == 0)
+    {
+        send_str(PSTR(" not supported\r\n"));
+        return;
+    }
+    send_str(PSTR(" min "));
+    print_address(b->min, 0);
+    send_str(PSTR(" avg "));
+    print_address(bench_avg(b), 0);
+    send_str(PSTR(" max "));
+    print_address(b->max, 0);
+    send_str(PSTR(" hist"));
+    for (uint8_t i = 0; i < BENCH_BINS; i++)
+    {
+        out_char(' ');
+        out_hex(b->hist[i], 2);
+    }
+    send_str(PSTR("\r\n"));
+}
+
+/* one timed erase, returns us */
+static uint32_t
+bench_erase(uint8_t op, uint32_t addr)
+{
+    spi_write_enable();
+    spi_cs(1);
+    spi_cmd_addr(op, addr);
+    spi_cs(0);
+    return spi_wait_wip(spi_op_timeout(op)) * TIMER_US_PER_TICK;
+}
+
+/* one timed page (or AAI word) of zeros, returns us */
+static uint32_t
+bench_program(uint32_t addr)
+{
+    static const uint8_t zero[2];
+    if (chip.flags & CHIP_SST_AAI)
+    {
+        const uint32_t start = timer_ticks();
+        spi_program_aai(addr, zero, 2);
+        return (timer_ticks() - start) * TIMER_US_PER_TICK;
+    }
+    spi_write_enable();
+    spi_cs(1);
+    spi_cmd_addr(0x02, addr);
+    for (uint16_t i = 1 << chip.page_shift; i; i--)
+    {
+        spi_send(0x00);
+    }
+    spi_cs(0);
+    return spi_wait_wip(spi_op_timeout(0x02)) * TIMER_US_PER_TICK;
+}
+
+/* M addr: time program and erase on the 64k scratch block at addr,
+ * the averages replace the typical times of the chip entry
+ */
+static void
+spi_benchmark(void)
+{
+    uint32_t addr = usb_serial_readhex();
+    if ((addr & 0xFFFF) != 0 || addr + 65536 > target_flash_size)
+    {
+        spi_fail(PSTR("scratch block must be 64k aligned and inside the flash\r\n"));
         return;
     }
-    
-    uint32_t led_on = 1;
-    uint32_t led_count = 0;
-    /* turn LED on if it wasn't already */
-    out(0xD6, 1);
-    
-    uint32_t offset = 0;
-    const size_t chunk_size = sizeof(xmodem_block.data);
-    uint8_t * const buf = xmodem_block.data;
-    
-    for (offset = 0 ; offset < len ; offset += chunk_size)
+    send_str(PSTR("Benchmarking, 64k at "));
+    print_address(addr, 1);
+
+    bench_t pp = {0}, se = {0}, be32 = {0}, be64 = {0};
+    spi_power(1);
+    _delay_ms(2);
+    spi_unprotect();
+
+    for (uint8_t round = 0; round < BENCH_ROUNDS; round++)
     {
-        // read 128 bytes into the xmodem data block
-        for (uint8_t i = 0 ; i < chunk_size; i++)
+        /* program before every erase so nothing is timed on a blank block */
+        for (uint8_t page = 0; page < 4; page++)
         {
-            int c;
-            while ((c = usb_serial_getchar()) == -1)
-            {
-                ;
-            }
-            buf[i] = c;
+            bench_add(&pp, bench_program(addr + page * 1024UL));
         }
-        
-        if ((addr & SPI_PAGE_MASK) == 0)
+        if (chip.flags & CHIP_ERASE_4K)
         {
-            // new sector; erase this one
-            spi_write_enable();
-            spi_erase_sector(addr);
+            bench_add(&se, bench_erase(0x20, addr));
+            bench_program(addr);
         }
-        
-        spi_write_enable();
-        uint8_t r2 = spi_status();
-        
-        spi_cs(1);
-        /* page program command */
-        spi_send(0x02);
-        spi_send(addr >> 16);
-        spi_send(addr >>  8);
-        spi_send(addr >>  0);
-        
-        for (uint8_t i = 0 ; i < chunk_size ; i++)
+        if (chip.flags & CHIP_ERASE_32K)
         {
-            spi_send(buf[i]);
-            bytes_uploaded++;
+            bench_add(&be32, bench_erase(0x52, addr));
+            bench_program(addr);
         }
-        
-        /* turn on/off led */
-        if (led_count == 0x50)
+        if (chip.flags & CHIP_ERASE_64K)
         {
-            if (led_on == 0)
-            {
-                out(0xD6, 1);
-                led_on = 1;
-            }
-            else if (led_on == 1)
+            bench_add(&be64, bench_erase(0xD8, addr));
+        }
+        else
+        {
+            /* leave the block blank for the next round */
+            if (spi_erase_range(addr, 65536) < 0)
             {
-                led_on = 0;
-                out(0xD6,0);
+                spi_power(0);
+                spi_fail(PSTR("scratch block can't be erased\r\n"));
+                return;
             }
-            led_count = 0;
         }
-        led_count++;
-        
-        spi_cs(0);
-        
-        // wait for write to finish
-        while (spi_status() & SPI_WIP)
+        if (spi_aborted)
         {
-            ;
+            return;
         }
-        
-        addr += chunk_size;
     }
-    
-    send_str(PSTR("done!\r\n"));
+    spi_power(0);
+
+    send_str(PSTR("times in us, hist <256us <1ms <4ms <16ms <64ms <256ms <1s >=1s\r\n"));
+    bench_print(&pp, PSTR("tPP   "));
+    bench_print(&se, PSTR("tSE   "));
+    bench_print(&be32, PSTR("tBE32 "));
+    bench_print(&be64, PSTR("tBE64 "));
+
+    /* tune the planner and ETAs with what this part actually does, the
+     * maxima stay the datasheet ones since they bound every wait
+     */
+    if (pp.n)
+    {
+        chip.tpp_typ = bench_avg(&pp) > UINT16_MAX ? UINT16_MAX : bench_avg(&pp);
+    }
+    if (se.n)
+    {
+        chip.tse_typ = bench_avg(&se) / 1000;
+    }
+    if (be32.n)
+    {
+        chip.tbe32_typ = bench_avg(&be32) / 1000;
+    }
+    if (be64.n)
+    {
+        chip.tbe64_typ = bench_avg(&be64) / 1000;
+    }
 }
 
+/* T ms: progress frame interval, 0 turns them off */
 static void
-spi_stats(void)
+spi_change_progress(void)
 {
-    send_str(PSTR("Uploaded and written bytes: "));
-    print_address(bytes_uploaded, 1);
+    progress_interval = usb_serial_readhex();
+    send_str(PSTR("Progress interval (ms): "));
+    print_address(progress_interval, 1);
+}
+
+static void
+spi_change_clock(void)
+{
+    send_menu(PSTR("Select SPI clock:\r\n"));
+    send_menu(PSTR("0 - fosc/2\r\n"));
+    send_menu(PSTR("1 - fosc/4\r\n"));
+    send_menu(PSTR("2 - fosc/8\r\n"));
+    send_menu(PSTR("3 - fosc/16\r\n"));
+    send_menu(PSTR("4 - fosc/32\r\n"));
+    send_menu(PSTR("5 - fosc/64\r\n"));
+    send_menu(PSTR("6 - fosc/128\r\n"));
+    send_menu(PSTR("\r\nDefault is fosc/4\r\n"));
+    uint32_t level = usb_serial_readhex();
+
+    if (level > SPI_CLOCK_SLOWEST)
+    {
+        spi_fail(PSTR("ERROR: Invalid clock selected.\r\n"));
+        return;
+    }
+    spi_clock_base = level;
+    spi_set_clock(level);
 }
 
 static void
 spi_change_flash_size(void)
 {
-    send_str(PSTR("Select target flash size:\r\n"));
-    send_str(PSTR("0 - 1MB (8 Mbit)\r\n"));
-    send_str(PSTR("1 - 2MB (16 Mbit)\r\n"));
-    send_str(PSTR("2 - 4MB (32 Mbit)\r\n"));
-    send_str(PSTR("3 - 8MB (64 Mbit)\r\n"));
-    send_str(PSTR("4 - 16MB (128 Mbit)\r\n"));
-    send_str(PSTR("5 - 32MB (256 Mbit)\r\n"));
-    send_str(PSTR("6 - 64K (512 Kbit)\r\n"));
-    send_str(PSTR("7 - 128K (1 Mbit)\r\n"));
-    send_str(PSTR("8 - 256K (2 Mbit)\r\n"));
-    send_str(PSTR("\r\nDefault is 64 Mbit\r\n"));
+    send_menu(PSTR("Select target flash size:\r\n"));
+    send_menu(PSTR("0 - 1MB (8 Mbit)\r\n"));
+    send_menu(PSTR("1 - 2MB (16 Mbit)\r\n"));
+    send_menu(PSTR("2 - 4MB (32 Mbit)\r\n"));
+    send_menu(PSTR("3 - 8MB (64 Mbit)\r\n"));
+    send_menu(PSTR("4 - 16MB (128 Mbit)\r\n"));
+    send_menu(PSTR("5 - 32MB (256 Mbit)\r\n"));
+    send_menu(PSTR("6 - 64K (512 Kbit)\r\n"));
+    send_menu(PSTR("7 - 128K (1 Mbit)\r\n"));
+    send_menu(PSTR("8 - 256K (2 Mbit)\r\n"));
+    send_menu(PSTR("\r\nDefault is 64 Mbit\r\n"));
     uint32_t size = usb_serial_readhex();
     
     switch (size) {
@@ -1499,10 +3622,479 @@ spi_change_flash_size(void)
             target_flash_size = 1L << 18;
             break;
         default:
-            send_str(PSTR("ERROR: Invalid target size selected.\r\n"));
+            spi_fail(PSTR("ERROR: Invalid target size selected.\r\n"));
+            break;
+    }
+
+    /* anything above 16MB needs four address bytes */
+    if (target_flash_size > (16L << 20))
+    {
+        send_str(PSTR("Select 4-byte addressing:\r\n"));
+        send_str(PSTR("0 - 4-byte opcodes (0x13/0x12/0x21/0xDC)\r\n"));
+        send_str(PSTR("1 - enter 4-byte address mode (0xB7)\r\n"));
+        uint32_t mode = usb_serial_readhex();
+        spi_power(1);
+        _delay_ms(2);
+        spi_set_addr_mode(mode == 1 ? SPI_ADDR_4B_MODE : SPI_ADDR_4B_OPCODES);
+    }
+    else
+    {
+        spi_set_addr_mode(SPI_ADDR_3B);
+    }
+}
+
+/* X len: run a batch of raw SPI transactions back to back, len bytes
+ * of binary descriptors follow the line, each one framed by CS:
+ *   flags    bits 0-2 address length (0, 3 or 4), bit 7 wait for WIP after
+ *   opcode
+ *   address  MSB first
+ *   dummy    number of 0x00 bytes clocked after the address
+ *   wlen     write payload length, followed by the payload
+ *   rlen     number of bytes read back
+ * replies with one line: #X <transactions> <bytes read> <read bytes in hex>
+ * the reads are buffered, a cancelled or timed out batch gets no record
+ */
+static void
+spi_raw_batch(void)
+{
+    host_sending = 1;
+    const uint32_t len = usb_serial_readhex();
+    uint8_t * const buf = xmodem_block.data;
+    if (len == 0 || len > sizeof(xmodem_block.data))
+    {
+        spi_fail(PSTR("batch must be 1 to 80 bytes\r\n"));
+        return;
+    }
+    out_flush();
+    if (usb_serial_read(buf, len, UPLOAD_TIMEOUT) != (int16_t)len)
+    {
+        spi_fail(PSTR("batch timeout\r\n"));
+        return;
+    }
+
+    /* check the whole batch before anything reaches the chip */
+    uint8_t count = 0;
+    uint16_t total = 0;
+    uint16_t off = 0;
+    while (off < len)
+    {
+        const uint8_t alen = buf[off] & 0x7;
+        off += 2 + alen + 1;
+        if ((alen != 0 && alen != 3 && alen != 4) || off >= len)
+        {
+            break;
+        }
+        off += 1 + buf[off];
+        if (off >= len)
+        {
+            break;
+        }
+        total += buf[off++];
+        count++;
+    }
+    if (off != len)
+    {
+        spi_fail(PSTR("bad descriptor in batch\r\n"));
+        return;
+    }
+    if (total > RAW_READ_MAX)
+    {
+        spi_fail(PSTR("batch reads more than 80 bytes\r\n"));
+        return;
+    }
+
+    uint8_t rbuf[RAW_READ_MAX];
+    uint8_t *r = rbuf;
+    uint8_t done = 0;
+    spi_power(1);
+    _delay_ms(2);
+    for (off = 0; off < len; )
+    {
+        const uint8_t flags = buf[off++];
+        const uint8_t op = buf[off++];
+        spi_cs(1);
+        spi_send(op);
+        for (uint8_t i = flags & 0x7; i; i--)
+        {
+            spi_send(buf[off++]);
+        }
+        for (uint8_t i = buf[off++]; i; i--)
+        {
+            spi_send(0x00);
+        }
+        for (uint8_t i = buf[off++]; i; i--)
+        {
+            spi_send(buf[off++]);
+        }
+        for (uint8_t i = buf[off++]; i; i--)
+        {
+            *r++ = spi_send(0x00);
+        }
+        spi_cs(0);
+        if (flags & 0x80)
+        {
+            /* an opcode without a datasheet time may still be an erase */
+            uint32_t limit = spi_op_timeout(op);
+            if (limit < spi_op_timeout(0xD8))
+            {
+                limit = spi_op_timeout(0xD8);
+            }
+            spi_wait_wip(limit);
+        }
+        if (spi_aborted)
+        {
+            send_str(PSTR("batch stopped at transaction "));
+            print_address(done, 1);
+            return;
+        }
+        done++;
+    }
+    spi_power(0);
+
+    send_str(PSTR("#X "));
+    out_hex(count, 2);
+    out_char(' ');
+    out_hex(total, 4);
+    out_char(' ');
+    for (uint8_t *p = rbuf; p < r; p++)
+    {
+        out_hex(*p, 2);
+    }
+    send_str(PSTR("\r\n"));
+}
+
+/* Y mode len: throughput of one stage in isolation, timed with the
+ * hardware timer
+ *   1 SPI read from address 0 into a discarded buffer
+ *   2 USB TX of a generated pattern, no SPI
+ *   3 USB RX, the host sends len bytes that are thrown away
+ *   4 end to end, SPI read from address 0 streamed to the host like d
+ * modes 2 and 4 send len binary bytes first, then all modes report
+ * #Y <mode> <bytes> <ticks> <bytes/s>
+ */
+static void
+spi_throughput(void)
+{
+    const uint32_t mode = usb_serial_readhex();
+    const uint32_t len = usb_serial_readhex();
+    if (mode < 1 || mode > 4)
+    {
+        spi_fail(PSTR("mode must be 1 to 4\r\n"));
+        return;
+    }
+    uint8_t buf[64];
+    for (uint8_t i = 0; i < sizeof(buf); i++)
+    {
+        buf[i] = i;
+    }
+
+    if (mode == 1 || mode == 4)
+    {
+        spi_power(1);
+        _delay_ms(2);
+        spi_read_begin(0);
+    }
+    if (mode == 2 || mode == 4)
+    {
+        out_flush();
+        usb_serial_stream_begin();
+    }
+    host_sending = (mode == 3);
+    if (host_sending)
+    {
+        out_flush();
+    }
+
+    const uint32_t start = timer_ticks();
+    uint32_t done = 0;
+    while (done < len)
+    {
+        uint8_t n = len - done < sizeof(buf) ? len - done : sizeof(buf);
+        if (mode == 1 || mode == 4)
+        {
+            spi_read_block(buf, n);
+        }
+        if (mode == 2 || mode == 4)
+        {
+            if (usb_serial_stream_write(buf, n) < 0)
+            {
+                break;
+            }
+        }
+        if (mode == 3)
+        {
+            if (usb_serial_read(buf, n, UPLOAD_TIMEOUT) != n)
+            {
+                break;
+            }
+        }
+        done += n;
+        if ((done & 0xFFF) == 0 && spi_cancelled())
+        {
             break;
+        }
+    }
+    const uint32_t ticks = timer_ticks() - start;
+
+    if (mode == 2 || mode == 4)
+    {
+        usb_serial_stream_end();
+    }
+    if (mode == 1 || mode == 4)
+    {
+        spi_read_end();
+        spi_power(0);
+    }
+    if (done != len && !spi_aborted)
+    {
+        spi_fail(PSTR("throughput test stopped early\r\n"));
+    }
+
+    char line[3 + 4 * 9];
+    uint8_t off = 0;
+    line[off++] = '#';
+    line[off++] = 'Y';
+    line[off++] = ' ';
+    off += progress_hex(&line[off], mode);
+    off += progress_hex(&line[off], done);
+    off += progress_hex(&line[off], ticks);
+    off += progress_hex(&line[off], bytes_per_sec(done, ticks / TIMER_TICKS_PER_MS));
+    line[off - 1] = '\r';
+    line[off++] = '\n';
+    out_write(line, off);
+}
+
+/* one "key=hex" field of the capability descriptor */
+static void
+cap_field(const char *key, uint32_t val, uint8_t digits)
+{
+    out_char(' ');
+    send_str(key);
+    out_char('=');
+    out_hex(val, digits);
+}
+
+/* V: one line describing what this firmware and the attached chip
+ * support, all values hex:
+ * ver  firmware version            db   chip database version, entries
+ * blk  upload/verify/xmodem block  pkt  dump packet
+ * win  xmodem window               scr  longest script
+ * pat  longest patch               enc  text encodings: 1 hex, 2 Ascii85
+ * xfer 1 raw dump, 2 xmodem, 4 upload, 8 verify, 10 script,
+ *      20 control interface open, 40 cancel, 80 raw SPI batch
+ * spi  1 hardware SPI, 2 bit-banged, 4 dual/quad
+ * rd   read modes: 1 single, 2 dual, 4 quad
+ * clk  fastest, slowest and current divider (0 = fosc/2)
+ * id size sec pg er flags   chip geometry, erase sizes (1 4K, 2 32K,
+ *      4 64K) and chip database flags, from the last i
+ */
+static void
+spi_capabilities(void)
+{
+    send_str(PSTR("#V"));
+    cap_field(PSTR("ver"), FIRMWARE_VERSION, 4);
+    cap_field(PSTR("db"), ((uint16_t)CHIP_DB_VERSION << 8) | chip_db_count(), 4);
+    cap_field(PSTR("blk"), sizeof(xmodem_block.data), 4);
+    cap_field(PSTR("pkt"), 64, 4);
+    cap_field(PSTR("win"), 1, 2);
+    cap_field(PSTR("scr"), SCRIPT_MAX, 4);
+    cap_field(PSTR("pat"), PATCH_MAX, 4);
+    cap_field(PSTR("enc"), 0x3, 2);
+    cap_field(PSTR("xfer"), 0xDF | (usb_ctrl_open() ? 0x20 : 0), 2);
+    uint8_t spi = 0;
+    uint8_t rd = 1;
+#ifdef CONFIG_SPI_HW
+    spi |= 1;
+#else
+    spi |= 2;
+#endif
+#ifdef CONFIG_SPI_QIO
+    spi |= 4;
+    rd |= 2 | 4;
+#endif
+    cap_field(PSTR("spi"), spi, 2);
+    cap_field(PSTR("rd"), rd, 2);
+    cap_field(PSTR("clk"), ((uint32_t)SPI_CLOCK_FASTEST << 16)
+        | ((uint16_t)SPI_CLOCK_SLOWEST << 8) | spi_clock_base, 6);
+    cap_field(PSTR("id"), ((uint32_t)chip.id[0] << 16) | ((uint16_t)chip.id[1] << 8) | chip.id[2], 6);
+    cap_field(PSTR("size"), target_flash_size, 8);
+    cap_field(PSTR("sec"), 1UL << chip.sector_shift, 8);
+    cap_field(PSTR("pg"), 1UL << chip.page_shift, 4);
+    cap_field(PSTR("er"), chip.flags & (CHIP_ERASE_4K | CHIP_ERASE_32K | CHIP_ERASE_64K), 2);
+    cap_field(PSTR("flags"), chip.flags, 4);
+    send_str(PSTR("\r\n"));
+}
+
+/* run one command, with the erase task suspended or finished first */
+static void
+spi_command(int c)
+{
+    spi_aborted = 0;
+    cancel_req = 0;
+    if (task_count())
+    {
+        if (spi_cmd_allows(c))
+        {
+            spi_erase_suspend();
+        }
+        else
+        {
+            /* anything else queues behind the running tasks,
+             * USB flow control holds the host off meanwhile
+             */
+            task_wait();
+        }
     }
     
+    switch(c)
+    {
+        case 'i': spi_rdid(); break;
+        case 'r': spi_read(); break;
+        case 'R': spi_read_size(); break;
+        case 'a': spi_read_base85(); break;
+        case 'd': spi_dump(); break;
+        case 'w': spi_write_enable_interactive(); break;
+        case 'e': spi_erase_sector_interactive(); break;
+        case 'u': spi_upload(); break;
+        case 'b': spi_biosupload(); break;
+        case '1': spi_flasharea(0x190000, 0x1A0000); break;
+        case '2': spi_flasharea(0x330000, 0x30000); break;
+        case '3': spi_flasharea(0x360000, 0x2A0000); break;
+        case XMODEM_NAK:
+            prom_send();
+            send_str(PSTR("xmodem done\r\n"));
+            if (integrity_mode)
+            {
+                spi_integrity_report();
+            }
+            break;
+        case 'x': {
+            uint8_t x = DDRB;
+            out_hex(x, 2);
+            break;
+        }
+        case 'f': spi_erase_pwd(); break;
+        case 'l': spi_locate_pwd(); break;
+        case 'H': spi_hash(); break;
+        case 'v': spi_verify(); break;
+        case 's': spi_stats(); break;
+        case 'h': help(); break;
+        case 'k': spi_resetnvram(); break;
+        case 'p': spi_patch_interactive(); break;
+        case 'o': spi_set_scratch(); break;
+        case 'E': spi_erase_8mb(); break;
+        case 'B': spi_erase_queue(0, target_flash_size, 0x60); break;
+        case 'Q': spi_erase_queue(0, target_flash_size, 0xC7); break;
+        case 'A': spi_erase_queue(0, target_flash_size, 0); break;
+        case 'C': spi_chip_erase(); break;
+        case 'P': spi_erase_range_interactive(); break;
+        case 'K': spi_blank_check_interactive(); break;
+        case 'z': spi_zap_8mb(); break;
+        case 'S': spi_change_flash_size(); break;
+        case 'G': spi_change_integrity_mode(); break;
+        case 'c': spi_change_clock(); break;
+        case 'T': spi_change_progress(); break;
+        case 'M': spi_benchmark(); break;
+        case 'V': spi_capabilities(); break;
+        case 'X': spi_raw_batch(); break;
+        case 'Y': spi_throughput(); break;
+#ifdef CONFIG_SPI_QIO
+        case 'm': spi_change_read_mode(); break;
+#endif
+        case XMODEM_CAN:
+            if (spi_erase_active())
+            {
+                spi_abort(PSTR("erase cancelled\r\n"));
+            }
+            break;
+        default:
+            out_char('?');
+            cmd_failed = 1;
+            break;
+    }
+
+    spi_erase_resume();
+    /* a running upload task keeps the data channel */
+    host_sending = upload_len != 0;
+}
+
+/* ! cmds...: run a script of commands and their arguments from one
+ * line, back to back and without echo, stopping at the first one that
+ * fails.  Ends with one record:
+ * #R <steps run> <index of the failed step, or FFFFFFFF> <ms>
+ * upload data follows the line and is read by each upload in turn.
+ */
+static void
+spi_script(void)
+{
+    uint8_t overflow = 0;
+    script_len = 0;
+    while (1)
+    {
+        int c = spi_getchar();
+        if (c == -1)
+        {
+            continue;
+        }
+        if (c == '\r' || c == '\n')
+        {
+            break;
+        }
+        if (script_len == SCRIPT_MAX)
+        {
+            overflow = 1;
+            continue;
+        }
+        script[script_len++] = c;
+    }
+
+    const uint32_t start = timer_ticks();
+    uint32_t steps = 0;
+    uint32_t failed = UINT32_MAX;
+    if (overflow)
+    {
+        spi_fail(PSTR("script too long\r\n"));
+        script_len = 0;
+        failed = 0;
+    }
+
+    script_pos = 0;
+    script_active = 1;
+    while (1)
+    {
+        if (script_pos >= script_len)
+        {
+            break;
+        }
+        int c = usb_serial_getchar_echo();
+        if (c == ';' || c == ' ')
+        {
+            continue;
+        }
+        cmd_failed = 0;
+        spi_command(c);
+        /* the result covers background erases too */
+        task_wait();
+        if (cmd_failed)
+        {
+            failed = steps;
+            break;
+        }
+        steps++;
+    }
+    script_active = 0;
+
+    char buf[3 + 3 * 9];
+    uint8_t off = 0;
+    buf[off++] = '#';
+    buf[off++] = 'R';
+    buf[off++] = ' ';
+    off += progress_hex(&buf[off], steps);
+    off += progress_hex(&buf[off], failed);
+    off += progress_hex(&buf[off], (timer_ticks() - start) / TIMER_TICKS_PER_MS);
+    buf[off - 1] = '\r';
+    buf[off++] = '\n';
+    out_write(buf, off);
 }
 
 int main(void)
@@ -1519,6 +4111,9 @@ int main(void)
 	// without a PC connected to the USB port, this 
 	// will wait forever.
 	usb_init();
+	timer_init();
+	// generic chip until RDID finds something better
+	chip_lookup(&chip, 0, 0, 0);
 	while (!usb_configured())
     {
 		continue;
@@ -1555,6 +4150,12 @@ int main(void)
 	cbi(PORTB, 3); // no pull up
 	cbi(DDRB, 3);
 
+#ifdef CONFIG_SPI_QIO
+	// IO lines are inputs, pull ups keep WP#/HOLD# high
+	SPI_QIO_DDR &= ~SPI_QIO_MASK;
+	SPI_QIO_PORT |= SPI_QIO_MASK;
+#endif
+
 	// keep it off and unselected
 	spi_power(0);
 	spi_cs(0);
@@ -1562,7 +4163,7 @@ int main(void)
 	send_str(PSTR("spi\r\n"));
 
 #ifdef CONFIG_SPI_HW
-	// Enable SPI in master mode, clock/16 == 500 KHz
+	// Enable SPI in master mode, clock/4 == 2 MHz, see spi_set_clock()
 	// Clocked on falling edge (CPOL=0, CPHA=1, PIC terms == CKP=0, CKE=1)
     SPCR = 0
         | (1 << SPE)  // enable SPI
@@ -1582,51 +4183,32 @@ int main(void)
 
 	while (1)
 	{
-		usb_serial_putchar('>');
+        /* an upload owns the data channel until it has been written */
+        while (upload_len)
+        {
+            spi_ctrl_idle();
+            task_poll();
+            out_flush();
+        }
+
+		out_char('>');
+        out_flush();
 
 		int c;
-		while ((c = usb_serial_getchar()) == -1)
+		while ((c = spi_getchar()) == -1)
         {
-			;
+            spi_ctrl_idle();
+			task_poll();
+            out_flush();
         }
-        
-        switch(c)
-        {
-            case 'i': spi_rdid(); break;
-            case 'r': spi_read(); break;
-            case 'R': spi_read_size(); break;
-            case 'd': spi_dump(); break;
-            case 'w': spi_write_enable_interactive(); break;
-            case 'e': spi_erase_sector_interactive(); break;
-            case 'u': spi_upload(); break;
-            case 'b': spi_biosupload(); break;
-            case '1': spi_flasharea(0x190000, 0x1A0000); break;
-            case '2': spi_flasharea(0x330000, 0x30000); break;
-            case '3': spi_flasharea(0x360000, 0x2A0000); break;
-            case XMODEM_NAK:
-                prom_send();
-                send_str(PSTR("xmodem done\r\n"));
-                break;
-            case 'x': {
-                uint8_t x = DDRB;
-                usb_serial_putchar(hexdigit(x >> 4));
-                usb_serial_putchar(hexdigit(x >> 0));
-                break;
-            }
-            case 'f': spi_erase_pwd(); break;
-            case 'l': spi_locate_pwd(); break;
-            case 's': spi_stats(); break;
-            case 'h': help(); break;
-            case 'k': spi_resetnvram(); break;
-            case 'E': spi_erase_8mb(); break;
-            case 'B': spi_bulk_erase_S25FL128S(); break;
-            case 'Q': spi_bulk_erase_N25Q064A(); break;
-            case 'A': spi_bulk_erase_MX25L64(); break;
-            case 'z': spi_zap_8mb(); break;
-            case 'S': spi_change_flash_size(); break;
-            default:
-                usb_serial_putchar('?');
-                break;
+
+        if (c == '!')
+        {
+            spi_script();
+        }
+        else
+        {
+            spi_command(c);
         }
 	}
 }
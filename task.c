@@ -0,0 +1,121 @@
+/*
+ *                .__  _____.__                .__
+ *   ____________ |__|/ ____\  | _____    _____|  |__
+ *  /  ___/\____ \|  \   __\|  | \__  \  /  ___/  |  \
+ *  \___ \ |  |_> >  ||  |  |  |__/ __ \_\___ \|   Y  \
+ * /____  >|   __/|__||__|  |____(____  /____  >___|  /
+ *      \/ |__|                       \/     \/     \/
+ *
+ * SPI Flash reader.
+ *
+ * Very fast reader for SPI flashes for Teensy 2.x.
+ *
+ * Original code by Trammell Hudson (https://trmm.net/SPI)
+ * Modifications and addons by Pedro Vilaça - https://reverse.put.as - reverser@put.as
+ *
+ * Copyright (C) 2012 Trammell Hudson
+ * Copyright (C) 2015, 2016, 2017 Pedro Vilaça
+ *
+ * Hardware pinout reference: https://papers.put.as/papers/macosx/2015/44Con_2015_-_Efi_Monsters.pdf
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * task.c
+ *
+ * Cooperative scheduler for long running operations
+ *
+ * Tasks are step functions called from the main loop while it waits
+ * for input; a step must never block on the flash or the host.
+ *
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "task.h"
+
+static task_fn_t tasks[TASK_MAX];
+
+
+int8_t
+task_start(
+	task_fn_t fn
+)
+{
+	int8_t slot = -1;
+
+	for (uint8_t i = 0 ; i < TASK_MAX ; i++)
+	{
+		if (tasks[i] == fn)
+			return -1;
+		if (!tasks[i] && slot < 0)
+			slot = i;
+	}
+
+	if (slot < 0)
+		return -1;
+
+	tasks[slot] = fn;
+	return 0;
+}
+
+
+void
+task_stop(
+	task_fn_t fn
+)
+{
+	for (uint8_t i = 0 ; i < TASK_MAX ; i++)
+		if (tasks[i] == fn)
+			tasks[i] = NULL;
+}
+
+
+uint8_t
+task_poll(void)
+{
+	uint8_t running = 0;
+
+	for (uint8_t i = 0 ; i < TASK_MAX ; i++)
+	{
+		if (!tasks[i])
+			continue;
+		if (tasks[i]())
+			running++;
+		else
+			tasks[i] = NULL;
+	}
+
+	return running;
+}
+
+
+uint8_t
+task_count(void)
+{
+	uint8_t running = 0;
+
+	for (uint8_t i = 0 ; i < TASK_MAX ; i++)
+		if (tasks[i])
+			running++;
+
+	return running;
+}
+
+
+void
+task_wait(void)
+{
+	while (task_poll())
+		;
+}
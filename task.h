@@ -0,0 +1,84 @@
+/*
+ *                .__  _____.__                .__
+ *   ____________ |__|/ ____\  | _____    _____|  |__
+ *  /  ___/\____ \|  \   __\|  | \__  \  /  ___/  |  \
+ *  \___ \ |  |_> >  ||  |  |  |__/ __ \_\___ \|   Y  \
+ * /____  >|   __/|__||__|  |____(____  /____  >___|  /
+ *      \/ |__|                       \/     \/     \/
+ *
+ * SPI Flash reader.
+ *
+ * Very fast reader for SPI flashes for Teensy 2.x.
+ *
+ * Original code by Trammell Hudson (https://trmm.net/SPI)
+ * Modifications and addons by Pedro Vilaça - https://reverse.put.as - reverser@put.as
+ *
+ * Copyright (C) 2012 Trammell Hudson
+ * Copyright (C) 2015, 2016, 2017 Pedro Vilaça
+ *
+ * Hardware pinout reference: https://papers.put.as/papers/macosx/2015/44Con_2015_-_Efi_Monsters.pdf
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * task.h
+ *
+ * Cooperative scheduler for long running operations
+ *
+ */
+
+#ifndef _task_h_
+#define _task_h_
+
+#include <stdint.h>
+
+#define TASK_MAX	4
+
+/** A task step does a bounded amount of work and returns.
+ *
+ * \return non-zero while there is more to do, 0 once finished
+ */
+typedef uint8_t (*task_fn_t)(void);
+
+/** Queue a task.
+ *
+ * \return 0 on success, -1 if the table is full or it is already queued
+ */
+int8_t
+task_start(
+	task_fn_t fn
+);
+
+/** Remove a queued task, if it is there. */
+void
+task_stop(
+	task_fn_t fn
+);
+
+/** Run one step of every queued task.
+ *
+ * \return number of tasks still running
+ */
+uint8_t
+task_poll(void);
+
+/** Number of tasks still running. */
+uint8_t
+task_count(void);
+
+/** Run the queued tasks until they have all finished. */
+void
+task_wait(void);
+
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ *                .__  _____.__                .__
+ *   ____________ |__|/ ____\  | _____    _____|  |__
+ *  /  ___/\____ \|  \   __\|  | \__  \  /  ___/  |  \
+ *  \___ \ |  |_> >  ||  |  |  |__/ __ \_\___ \|   Y  \
+ * /____  >|   __/|__||__|  |____(____  /____  >___|  /
+ *      \/ |__|                       \/     \/     \/
+ *
+ * SPI Flash reader.
+ *
+ * Very fast reader for SPI flashes for Teensy 2.x.
+ *
+ * Original code by Trammell Hudson (https://trmm.net/SPI)
+ * Modifications and addons by Pedro Vilaça - https://reverse.put.as - reverser@put.as
+ *
+ * Copyright (C) 2012 Trammell Hudson
+ * Copyright (C) 2015, 2016, 2017 Pedro Vilaça
+ *
+ * Hardware pinout reference: https://papers.put.as/papers/macosx/2015/44Con_2015_-_Efi_Monsters.pdf
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * timer.c
+ *
+ * Free running tick counter on timer 1
+ *
+ * The 16 bit counter is extended to 32 bits by counting
+ * overflows in the interrupt handler.
+ *
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdint.h>
+#include "timer.h"
+
+static volatile uint16_t timer_overflows;
+
+ISR(TIMER1_OVF_vect)
+{
+	timer_overflows++;
+}
+
+
+void
+timer_init(void)
+{
+	TCCR1A = 0;
+	TCNT1 = 0;
+	/* normal mode, clk/64 */
+	TCCR1B = (1 << CS11) | (1 << CS10);
+	TIMSK1 = (1 << TOIE1);
+}
+
+
+uint32_t
+timer_ticks(void)
+{
+	const uint8_t intr_state = SREG;
+	cli();
+	uint16_t lo = TCNT1;
+	uint16_t hi = timer_overflows;
+	/* counter wrapped but the interrupt hasn't run yet */
+	if ((TIFR1 & (1 << TOV1)) && lo < 0x8000)
+		hi++;
+	SREG = intr_state;
+
+	return ((uint32_t) hi << 16) | lo;
+}
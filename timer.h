@@ -0,0 +1,61 @@
+/*
+ *                .__  _____.__                .__
+ *   ____________ |__|/ ____\  | _____    _____|  |__
+ *  /  ___/\____ \|  \   __\|  | \__  \  /  ___/  |  \
+ *  \___ \ |  |_> >  ||  |  |  |__/ __ \_\___ \|   Y  \
+ * /____  >|   __/|__||__|  |____(____  /____  >___|  /
+ *      \/ |__|                       \/     \/     \/
+ *
+ * SPI Flash reader.
+ *
+ * Very fast reader for SPI flashes for Teensy 2.x.
+ *
+ * Original code by Trammell Hudson (https://trmm.net/SPI)
+ * Modifications and addons by Pedro Vilaça - https://reverse.put.as - reverser@put.as
+ *
+ * Copyright (C) 2012 Trammell Hudson
+ * Copyright (C) 2015, 2016, 2017 Pedro Vilaça
+ *
+ * Hardware pinout reference: https://papers.put.as/papers/macosx/2015/44Con_2015_-_Efi_Monsters.pdf
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * timer.h
+ *
+ * Free running tick counter on timer 1
+ *
+ */
+
+#ifndef _timer_h_
+#define _timer_h_
+
+#include <avr/io.h>
+#include <stdint.h>
+
+/* timer 1 runs at F_CPU/64, 8 us per tick at 8 MHz */
+#define TIMER_PRESCALE      64
+#define TIMER_TICKS_PER_MS  (F_CPU / TIMER_PRESCALE / 1000)
+#define TIMER_US_PER_TICK   (1000000UL * TIMER_PRESCALE / F_CPU)
+
+
+void
+timer_init(void);
+
+
+/** Ticks since timer_init(), wraps after about 9.5 hours. */
+uint32_t
+timer_ticks(void);
+
+
+#endif
@@ -95,6 +95,21 @@
 // operating systems.
 #define SUPPORT_ENDPOINT_HALT
 
+// Move CDC data between the endpoints and RAM ring buffers from the
+// endpoint interrupt, so the host keeps streaming while the main
+// program is busy.  Without it the endpoints are only serviced when
+// the getchar/read/putchar/write functions are called.  The sizes
+// must be powers of two, no larger than 128.
+//#define USB_SERIAL_RING
+#define USB_RX_RING_SIZE	128
+#define USB_TX_RING_SIZE	128
+
+// Add a vendor specific interface with its own bulk endpoint pair as
+// a control channel, so status and progress can be exchanged while
+// the CDC interface is busy streaming data.  The host reaches it with
+// libusb; it is opened by sending it any byte.
+#define USB_SERIAL_CTRL
+
 
 
 /**************************************************************************
@@ -112,6 +127,8 @@
 #define CDC_ACM_ENDPOINT	2
 #define CDC_RX_ENDPOINT		3
 #define CDC_TX_ENDPOINT		4
+#define CTRL_RX_ENDPOINT	5
+#define CTRL_TX_ENDPOINT	6
 #if defined(__AVR_AT90USB162__)
 #define CDC_ACM_SIZE		16
 #define CDC_ACM_BUFFER		EP_SINGLE_BUFFER
@@ -119,6 +136,7 @@
 #define CDC_RX_BUFFER 		EP_DOUBLE_BUFFER
 #define CDC_TX_SIZE		32
 #define CDC_TX_BUFFER		EP_DOUBLE_BUFFER
+#undef USB_SERIAL_CTRL			// no DPRAM or endpoints left for it
 #else
 #define CDC_ACM_SIZE		16
 #define CDC_ACM_BUFFER		EP_SINGLE_BUFFER
@@ -126,13 +144,24 @@
 #define CDC_RX_BUFFER 		EP_DOUBLE_BUFFER
 #define CDC_TX_SIZE		64
 #define CDC_TX_BUFFER		EP_DOUBLE_BUFFER
+#define CTRL_RX_SIZE		64
+#define CTRL_RX_BUFFER		EP_SINGLE_BUFFER
+#define CTRL_TX_SIZE		64
+#define CTRL_TX_BUFFER		EP_SINGLE_BUFFER
 #endif
 
 static const uint8_t PROGMEM endpoint_config_table[] = {
 	0,
 	1, EP_TYPE_INTERRUPT_IN,  EP_SIZE(CDC_ACM_SIZE) | CDC_ACM_BUFFER,
 	1, EP_TYPE_BULK_OUT,      EP_SIZE(CDC_RX_SIZE) | CDC_RX_BUFFER,
-	1, EP_TYPE_BULK_IN,       EP_SIZE(CDC_TX_SIZE) | CDC_TX_BUFFER
+	1, EP_TYPE_BULK_IN,       EP_SIZE(CDC_TX_SIZE) | CDC_TX_BUFFER,
+#ifdef USB_SERIAL_CTRL
+	1, EP_TYPE_BULK_OUT,      EP_SIZE(CTRL_RX_SIZE) | CTRL_RX_BUFFER,
+	1, EP_TYPE_BULK_IN,       EP_SIZE(CTRL_TX_SIZE) | CTRL_TX_BUFFER
+#else
+	0,
+	0
+#endif
 };
 
 
@@ -152,9 +181,16 @@ static const struct usb_device_descriptor PROGMEM device_descriptor = {
 	.bLength		= sizeof(device_descriptor),
 	.bDescriptorType	= 1,
 	.bcdUSB			= 0x0200,
+#ifdef USB_SERIAL_CTRL
+	// composite device, the CDC function is grouped by an IAD
+	.bDeviceClass		= 0xEF,
+	.bDeviceSubClass	= 0x02,
+	.bDeviceProtocol	= 0x01,
+#else
 	.bDeviceClass		= USB_CLASS_COMM,
 	.bDeviceSubClass	= 0,
 	.bDeviceProtocol	= 0,
+#endif
 	.bMaxPacketSize0	= ENDPOINT0_SIZE,
 	.idVendor		= VENDOR_ID,
 	.idProduct		= PRODUCT_ID,
@@ -166,7 +202,13 @@ static const struct usb_device_descriptor PROGMEM device_descriptor = {
 };
 
 
+#ifdef USB_SERIAL_CTRL
+#define CONFIG1_DESC_SIZE (9+8+9+5+5+4+5+7+9+7+7+9+7+7)
+#define CONFIG1_INTERFACES 3
+#else
 #define CONFIG1_DESC_SIZE (9+9+5+5+4+5+7+9+7+7)
+#define CONFIG1_INTERFACES 2
+#endif
 #if 1
 static const uint8_t PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
 	// configuration descriptor, USB spec 9.6.3, page 264-266, Table 9-10
@@ -174,12 +216,23 @@ static const uint8_t PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
 	2,					// bDescriptorType;
 	LSB(CONFIG1_DESC_SIZE),			// wTotalLength
 	MSB(CONFIG1_DESC_SIZE),
-	2,					// bNumInterfaces
+	CONFIG1_INTERFACES,			// bNumInterfaces
 	1,					// bConfigurationValue
 	0,					// iConfiguration
 	0xC0,					// bmAttributes
 	50,					// bMaxPower
 
+#ifdef USB_SERIAL_CTRL
+	// interface association descriptor, USB ECN IAD, Table 9-Z
+	8,					// bLength
+	11,					// bDescriptorType
+	0,					// bFirstInterface
+	2,					// bInterfaceCount
+	0x02,					// bFunctionClass
+	0x02,					// bFunctionSubClass
+	0x01,					// bFunctionProtocol
+	0,					// iFunction
+#endif
 	// interface descriptor, USB spec 9.6.5, page 267-269, Table 9-12
 	9,					// bLength
 	4,					// bDescriptorType
@@ -242,7 +295,33 @@ static const uint8_t PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
 	CDC_TX_ENDPOINT | 0x80,			// bEndpointAddress
 	0x02,					// bmAttributes (0x02=bulk)
 	CDC_TX_SIZE, 0,				// wMaxPacketSize
-	0					// bInterval
+	0,					// bInterval
+#ifdef USB_SERIAL_CTRL
+	// interface descriptor, USB spec 9.6.5, page 267-269, Table 9-12
+	9,					// bLength
+	4,					// bDescriptorType
+	2,					// bInterfaceNumber
+	0,					// bAlternateSetting
+	2,					// bNumEndpoints
+	0xFF,					// bInterfaceClass (vendor)
+	0x00,					// bInterfaceSubClass
+	0x00,					// bInterfaceProtocol
+	0,					// iInterface
+	// endpoint descriptor, USB spec 9.6.6, page 269-271, Table 9-13
+	7,					// bLength
+	5,					// bDescriptorType
+	CTRL_RX_ENDPOINT,			// bEndpointAddress
+	0x02,					// bmAttributes (0x02=bulk)
+	CTRL_RX_SIZE, 0,			// wMaxPacketSize
+	0,					// bInterval
+	// endpoint descriptor, USB spec 9.6.6, page 269-271, Table 9-13
+	7,					// bLength
+	5,					// bDescriptorType
+	CTRL_TX_ENDPOINT | 0x80,		// bEndpointAddress
+	0x02,					// bmAttributes (0x02=bulk)
+	CTRL_TX_SIZE, 0,			// wMaxPacketSize
+	0,					// bInterval
+#endif
 };
 #else
 static struct usb_config_descriptor PROGMEM config1_descriptor = {
@@ -335,6 +414,27 @@ static volatile uint8_t usb_configuration=0;
 static volatile uint8_t transmit_flush_timer=0;
 static uint8_t transmit_previous_timeout=0;
 
+// set while a streaming write session is open, the start of frame
+// flush is left alone until it is closed
+static volatile uint8_t transmit_streaming=0;
+
+#ifdef USB_SERIAL_CTRL
+// set once the host has sent something to the control interface
+static volatile uint8_t ctrl_open=0;
+#endif
+
+#ifdef USB_SERIAL_RING
+// head is written by the producer, tail by the consumer, both run
+// freely and are masked on access so head - tail is the fill level
+static volatile uint8_t rx_ring[USB_RX_RING_SIZE];
+static volatile uint8_t rx_head=0, rx_tail=0;
+static volatile uint8_t rx_stalled=0;
+static volatile uint8_t tx_ring[USB_TX_RING_SIZE];
+static volatile uint8_t tx_head=0, tx_tail=0;
+static void usb_rx_resume(void);
+static int8_t usb_tx_push(const uint8_t *buffer, uint16_t size, uint8_t wait);
+#endif
+
 // serial port settings (baud rate, control signals, etc) set
 // by the PC.  These are ignored, but kept in RAM.
 static uint8_t cdc_line_coding[7]={0x00, 0xE1, 0x00, 0x00, 0x00, 0x00, 0x08};
@@ -374,6 +474,17 @@ int16_t usb_serial_getchar(void)
 {
 	uint8_t c, intr_state;
 
+#ifdef USB_SERIAL_RING
+	if (rx_head == rx_tail) {
+		usb_rx_resume();
+		return -1;
+	}
+	c = rx_ring[rx_tail & (USB_RX_RING_SIZE-1)];
+	rx_tail++;
+	usb_rx_resume();
+	return c;
+#endif
+
 	// interrupts are disabled so these functions can be
 	// used from the main program or interrupt context,
 	// even both in the same program!
@@ -408,6 +519,10 @@ uint8_t usb_serial_available(void)
 {
 	uint8_t n=0, i, intr_state;
 
+#ifdef USB_SERIAL_RING
+	return (uint8_t)(rx_head - rx_tail);
+#endif
+
 	intr_state = SREG;
 	cli();
 	if (usb_configuration) {
@@ -427,6 +542,11 @@ void usb_serial_flush_input(void)
 {
 	uint8_t intr_state;
 
+#ifdef USB_SERIAL_RING
+	rx_tail = rx_head;
+	usb_rx_resume();
+#endif
+
 	if (usb_configuration) {
 		intr_state = SREG;
 		cli();
@@ -439,59 +559,75 @@ void usb_serial_flush_input(void)
 }
 
 
-#if 0
-/**
- * Copy the receive buffer into a user space array, of at least 64 bytes.
- *
- * \return Number of bytes copied in this packet, 0 if none, -1 on error.
- */
-int8_t
-usb_serial_recv(
-	uint8_t * buf
-)
+// receive up to size bytes, a whole packet at a time.  Returns
+// when size bytes arrived or nothing came in for timeout ms.
+// Returns the number of bytes read, or -1 if not configured
+int16_t usb_serial_read(uint8_t *buffer, uint16_t size, uint16_t timeout)
 {
-	// interrupts are disabled so these functions can be
-	// used from the main program or interrupt context,
-	// even both in the same program!
-	const uint8_t intr_state = SREG;
-	cli();
-	if (!usb_configuration)
-	{
-		SREG = intr_state;
-		return -1;
-	}
+	uint8_t n, intr_state, frame;
+	uint16_t count=0, idle=0;
 
-	int offset = 0;
-
-	UENUM = CDC_RX_ENDPOINT;
-	while (1)
-	{
-		if (bit_is_clear(UEINTX, RWAL))
-		{
-			// No data in the buffer .
-			if (bit_is_clear(UEINTX, RXOUTI))
-			{
-				UEINTX = 0x6B;
-				goto retry;
-			}	
+	if (!usb_configuration) return -1;
+	frame = UDFNUML;
+#ifdef USB_SERIAL_RING
+	while (count < size) {
+		if (rx_head == rx_tail) {
+			usb_rx_resume();
+			if (!usb_configuration) return -1;
+			if (UDFNUML != frame) {
+				frame = UDFNUML;
+				if (++idle >= timeout) break;
+			}
+			continue;
+		}
+		idle = 0;
+		while (rx_head != rx_tail && count < size) {
+			*buffer++ = rx_ring[rx_tail & (USB_RX_RING_SIZE-1)];
+			rx_tail++;
+			count++;
+		}
+	}
+	usb_rx_resume();
+	return count;
+#endif
+	while (count < size) {
+		intr_state = SREG;
+		cli();
+		UENUM = CDC_RX_ENDPOINT;
+		n = UEINTX;
+		if (!(n & (1<<RWAL))) {
+			// no data, release an empty bank and wait
+			if (n & (1<<RXOUTI)) UEINTX = 0x6B;
 			SREG = intr_state;
-			return -1;
+			if (!usb_configuration) return -1;
+			if (UDFNUML != frame) {
+				frame = UDFNUML;
+				if (++idle >= timeout) break;
+			}
+			continue;
 		}
-
-		// take one byte out of the buffer
-		c = UEDATX;
+		idle = 0;
+		// copy what is left of this bank, or what fits
+		n = UEBCLX;
+		if (n > size - count) n = size - count;
+		count += n;
+		while (n--) *buffer++ = UEDATX;
 		// if buffer completely used, release it
-	if (!(UEINTX & (1<<RWAL))) UEINTX = 0x6B;
-	SREG = intr_state;
-	return c;
+		if (!(UEINTX & (1<<RWAL))) UEINTX = 0x6B;
+		SREG = intr_state;
+	}
+	return count;
 }
-#endif
 
 // transmit a character.  0 returned on success, -1 on error
 int8_t usb_serial_putchar(uint8_t c)
 {
 	uint8_t timeout, intr_state;
 
+#ifdef USB_SERIAL_RING
+	return usb_tx_push(&c, 1, 1);
+#endif
+
 	// if we're not online (enumerated and configured), error
 	if (!usb_configuration) return -1;
 	// interrupts are disabled so these functions can be
@@ -543,6 +679,10 @@ int8_t usb_serial_putchar_nowait(uint8_t c)
 {
 	uint8_t intr_state;
 
+#ifdef USB_SERIAL_RING
+	return usb_tx_push(&c, 1, 0);
+#endif
+
 	if (!usb_configuration) return -1;
 	intr_state = SREG;
 	cli();
@@ -577,6 +717,10 @@ int8_t usb_serial_write(const uint8_t *buffer, uint16_t size)
 {
 	uint8_t timeout, intr_state, write_size;
 
+#ifdef USB_SERIAL_RING
+	return usb_tx_push(buffer, size, 1);
+#endif
+
 	// if we're not online (enumerated and configured), error
 	if (!usb_configuration) return -1;
 	// interrupts are disabled so these functions can be
@@ -704,6 +848,73 @@ int8_t usb_serial_write(const uint8_t *buffer, uint16_t size)
 }
 
 
+// open a streaming write session for a long run of output, like a
+// dump.  Full packets are released as soon as they are filled, the
+// timeout is only armed while waiting for a free bank, and the start
+// of frame flush is suspended until usb_serial_stream_end().
+//  0 returned on success, -1 on error
+int8_t usb_serial_stream_begin(void)
+{
+	if (!usb_configuration) return -1;
+	transmit_streaming = 1;
+	transmit_flush_timer = 0;
+	transmit_previous_timeout = 0;
+	return 0;
+}
+
+// push bytes into an open streaming session.
+//  0 returned on success, -1 on timeout or error
+int8_t usb_serial_stream_write(const uint8_t *buffer, uint16_t size)
+{
+	uint8_t timeout, intr_state, n;
+
+#ifdef USB_SERIAL_RING
+	return usb_tx_push(buffer, size, 1);
+#endif
+	while (size) {
+		intr_state = SREG;
+		cli();
+		UENUM = CDC_TX_ENDPOINT;
+		if (!(UEINTX & (1<<RWAL))) {
+			// bank boundary, wait for the host to take one
+			SREG = intr_state;
+			timeout = UDFNUML + TRANSMIT_TIMEOUT;
+			while (1) {
+				if (UDFNUML == timeout) return -1;
+				if (!usb_configuration) return -1;
+				intr_state = SREG;
+				cli();
+				UENUM = CDC_TX_ENDPOINT;
+				if (UEINTX & (1<<RWAL)) break;
+				SREG = intr_state;
+			}
+		}
+		n = CDC_TX_SIZE - UEBCLX;
+		if (n > size) n = size;
+		size -= n;
+		while (n--) UEDATX = *buffer++;
+		if (!(UEINTX & (1<<RWAL))) UEINTX = 0x3A;
+		SREG = intr_state;
+	}
+	return 0;
+}
+
+// close the session, a partial packet is sent right away
+void usb_serial_stream_end(void)
+{
+	uint8_t intr_state;
+
+	intr_state = SREG;
+	cli();
+	if (usb_configuration) {
+		UENUM = CDC_TX_ENDPOINT;
+		if (UEBCLX) UEINTX = 0x3A;
+	}
+	transmit_streaming = 0;
+	SREG = intr_state;
+}
+
+
 // immediately transmit any buffered output.
 // This doesn't actually transmit the data - that is impossible!
 // USB devices only transmit when the host allows, so the best
@@ -722,6 +933,80 @@ void usb_serial_flush_output(void)
 	SREG = intr_state;
 }
 
+// has the host opened the control interface?
+uint8_t usb_ctrl_open(void)
+{
+#ifdef USB_SERIAL_CTRL
+	return ctrl_open;
+#else
+	return 0;
+#endif
+}
+
+// receive a byte from the control interface, never waits
+//  -1 returned if nothing is there
+int16_t usb_ctrl_getchar(void)
+{
+#ifdef USB_SERIAL_CTRL
+	uint8_t c, intr_state;
+
+	intr_state = SREG;
+	cli();
+	if (!usb_configuration) {
+		SREG = intr_state;
+		return -1;
+	}
+	UENUM = CTRL_RX_ENDPOINT;
+	retry:
+	c = UEINTX;
+	if (!(c & (1<<RWAL))) {
+		if (c & (1<<RXOUTI)) {
+			UEINTX = 0x6B;
+			goto retry;
+		}
+		SREG = intr_state;
+		return -1;
+	}
+	ctrl_open = 1;
+	c = UEDATX;
+	if (!(UEINTX & (1<<RWAL))) UEINTX = 0x6B;
+	SREG = intr_state;
+	return c;
+#else
+	return -1;
+#endif
+}
+
+// send one packet on the control interface.  It is dropped rather
+// than waited for when the host is not reading, so status never
+// stalls the data channel.
+//  0 returned on success, -1 if dropped
+int8_t usb_ctrl_write(const uint8_t *buffer, uint8_t size)
+{
+#ifdef USB_SERIAL_CTRL
+	uint8_t intr_state;
+
+	if (size > CTRL_TX_SIZE) return -1;
+	intr_state = SREG;
+	cli();
+	if (!usb_configuration) {
+		SREG = intr_state;
+		return -1;
+	}
+	UENUM = CTRL_TX_ENDPOINT;
+	if (!(UEINTX & (1<<RWAL))) {
+		SREG = intr_state;
+		return -1;
+	}
+	while (size--) UEDATX = *buffer++;
+	UEINTX = 0x3A;
+	SREG = intr_state;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
 // functions to read the various async serial settings.  These
 // aren't actually used by USB at all (communication is always
 // at full USB speed), but they are set by the host so we can
@@ -815,7 +1100,7 @@ ISR(USB_GEN_vect)
 		cdc_line_rtsdtr = 0;
         }
 	if (intbits & (1<<SOFI)) {
-		if (usb_configuration) {
+		if (usb_configuration && !transmit_streaming) {
 			t = transmit_flush_timer;
 			if (t) {
 				transmit_flush_timer = --t;
@@ -849,6 +1134,97 @@ static inline void usb_ack_out(void)
 
 
 
+#ifdef USB_SERIAL_RING
+// move a received packet into the RX ring.  If it doesn't fit the
+// interrupt is turned off and the packet stays in the endpoint (so
+// the host is NAKed) until the reader makes room
+static void usb_rx_isr(void)
+{
+	uint8_t n, i;
+
+	UENUM = CDC_RX_ENDPOINT;
+	i = UEINTX;
+	if (!(i & (1<<RWAL))) {
+		// zero length packet
+		if (i & (1<<RXOUTI)) UEINTX = 0x6B;
+		return;
+	}
+	n = UEBCLX;
+	if (n > USB_RX_RING_SIZE - (uint8_t)(rx_head - rx_tail)) {
+		UEIENX = 0;
+		rx_stalled = 1;
+		return;
+	}
+	while (n--) {
+		rx_ring[rx_head & (USB_RX_RING_SIZE-1)] = UEDATX;
+		rx_head++;
+	}
+	UEINTX = 0x6B;
+}
+
+// refill the TX bank from the ring, send it once full.  A partial
+// packet is sent by the start of frame flush timer
+static void usb_tx_isr(void)
+{
+	UENUM = CDC_TX_ENDPOINT;
+	while (tx_head != tx_tail && (UEINTX & (1<<RWAL))) {
+		UEDATX = tx_ring[tx_tail & (USB_TX_RING_SIZE-1)];
+		tx_tail++;
+		if (!(UEINTX & (1<<RWAL))) UEINTX = 0x3A;
+	}
+	if (tx_head == tx_tail) UEIENX = 0;
+	transmit_flush_timer = TRANSMIT_FLUSH_TIMEOUT;
+}
+
+// turn the RX interrupt back on once the ring has been read from
+static void usb_rx_resume(void)
+{
+	uint8_t intr_state;
+
+	if (!rx_stalled) return;
+	intr_state = SREG;
+	cli();
+	rx_stalled = 0;
+	UENUM = CDC_RX_ENDPOINT;
+	UEIENX = (1<<RXOUTE);
+	SREG = intr_state;
+}
+
+// queue data for the TX interrupt, waiting for room unless told not
+// to.  0 returned on success, -1 on timeout or error
+static int8_t usb_tx_push(const uint8_t *buffer, uint16_t size, uint8_t wait)
+{
+	uint8_t timeout, intr_state;
+
+	if (!usb_configuration) return -1;
+	while (size) {
+		timeout = UDFNUML + TRANSMIT_TIMEOUT;
+		while ((uint8_t)(tx_head - tx_tail) == USB_TX_RING_SIZE) {
+			if (!wait) return -1;
+			if (transmit_previous_timeout) return -1;
+			if (UDFNUML == timeout) {
+				transmit_previous_timeout = 1;
+				return -1;
+			}
+			if (!usb_configuration) return -1;
+		}
+		transmit_previous_timeout = 0;
+		while (size && (uint8_t)(tx_head - tx_tail) != USB_TX_RING_SIZE) {
+			tx_ring[tx_head & (USB_TX_RING_SIZE-1)] = *buffer++;
+			tx_head++;
+			size--;
+		}
+		intr_state = SREG;
+		cli();
+		UENUM = CDC_TX_ENDPOINT;
+		UEIENX = (1<<TXINE);
+		SREG = intr_state;
+	}
+	return 0;
+}
+#endif
+
+
 // USB Endpoint Interrupt - endpoint 0 is handled here.  The
 // other endpoints are manipulated by the user-callable
 // functions, and the start-of-frame interrupt.
@@ -869,8 +1245,16 @@ ISR(USB_COM_vect)
 	const uint8_t *desc_addr;
 	uint8_t	desc_length;
 
+#ifdef USB_SERIAL_RING
+	if (UEINT & (1<<CDC_RX_ENDPOINT)) usb_rx_isr();
+	if (UEINT & (1<<CDC_TX_ENDPOINT)) usb_tx_isr();
+#endif
         UENUM = 0;
         intbits = UEINTX;
+#ifdef USB_SERIAL_RING
+	// only a data endpoint interrupted, EP0 has no request to answer
+	if (!(intbits & (1<<RXSTPI))) return;
+#endif
         if (intbits & (1<<RXSTPI)) {
                 bmRequestType = UEDATX;
                 bRequest = UEDATX;
@@ -935,7 +1319,7 @@ ISR(USB_COM_vect)
 			transmit_flush_timer = 0;
 			usb_send_in();
 			cfg = endpoint_config_table;
-			for (i=1; i<5; i++) {
+			for (i=1; i<=MAX_ENDPOINT; i++) {
 				UENUM = i;
 				en = pgm_read_byte(cfg++);
 				UECONX = en;
@@ -944,8 +1328,18 @@ ISR(USB_COM_vect)
 					UECFG1X = pgm_read_byte(cfg++);
 				}
 			}
-        		UERST = 0x1E;
+        		UERST = 0x7E;
         		UERST = 0;
+#ifdef USB_SERIAL_CTRL
+			ctrl_open = 0;
+#endif
+#ifdef USB_SERIAL_RING
+			rx_head = rx_tail = 0;
+			tx_head = tx_tail = 0;
+			rx_stalled = 0;
+			UENUM = CDC_RX_ENDPOINT;
+			UEIENX = (1<<RXOUTE);
+#endif
 			return;
 		}
 		if (bRequest == GET_CONFIGURATION && bmRequestType == 0x80) {
@@ -11,12 +11,21 @@ uint8_t usb_configured(void);		// is the USB port configured
 int16_t usb_serial_getchar(void);	// receive a character (-1 if timeout/error)
 uint8_t usb_serial_available(void);	// number of bytes in receive buffer
 void usb_serial_flush_input(void);	// discard any buffered input
+int16_t usb_serial_read(uint8_t *buffer, uint16_t size, uint16_t timeout); // receive a buffer, timeout in ms
 
 // transmitting data
 int8_t usb_serial_putchar(uint8_t c);	// transmit a character
 int8_t usb_serial_putchar_nowait(uint8_t c);  // transmit a character, do not wait
 int8_t usb_serial_write(const uint8_t *buffer, uint16_t size); // transmit a buffer
 void usb_serial_flush_output(void);	// immediately transmit any buffered output
+int8_t usb_serial_stream_begin(void);	// open a streaming write session
+int8_t usb_serial_stream_write(const uint8_t *buffer, uint16_t size); // push into the session
+void usb_serial_stream_end(void);	// close it, sending any partial packet
+
+// control interface, kept apart from the data stream
+uint8_t usb_ctrl_open(void);		// has the host opened it
+int16_t usb_ctrl_getchar(void);		// receive a byte (-1 if none, never waits)
+int8_t usb_ctrl_write(const uint8_t *buffer, uint8_t size); // send one packet (-1 if dropped)
 
 // serial parameters
 uint32_t usb_serial_get_baud(void);	// get the baud rate
@@ -73,7 +82,7 @@ int8_t usb_serial_set_control(uint8_t signals); // set DSR, DCD, RI, etc
 			((s) == 16 ? 0x10 :	\
 			             0x00)))
 
-#define MAX_ENDPOINT		4
+#define MAX_ENDPOINT		6
 
 #define LSB(n) (n & 255)
 #define MSB(n) ((n >> 8) & 255)
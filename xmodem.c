@@ -68,6 +68,22 @@ xmodem_send(
 		cksum += block->data[i];
 
 	block->cksum = cksum;
+	return xmodem_send_block(block, wait_for_ack);
+}
+
+
+/** Send a block whose checksum was already computed,
+ * for example while the data was read in.
+ *
+ * \return 0 if all is ok, -1 if a cancel is requested or more
+ * than 10 retries occur.
+ */
+int
+xmodem_send_block(
+	xmodem_block_t * const block,
+	int wait_for_ack
+)
+{
 	block->block_num++;
 	block->block_num_complement = 0xFF - block->block_num;
 
@@ -122,6 +138,18 @@ xmodem_init(
 }
 
 
+/** Give up on a transfer the sender can't finish, for example
+ * when the data can't be read reliably.  The receiver stops on
+ * two CANs in a row.
+ */
+void
+xmodem_cancel(void)
+{
+	usb_serial_putchar(XMODEM_CAN);
+	usb_serial_putchar(XMODEM_CAN);
+}
+
+
 int
 xmodem_fini(
 	xmodem_block_t * const block
@@ -79,9 +79,20 @@ xmodem_send(
 );
 
 
+int
+xmodem_send_block(
+	xmodem_block_t * const block,
+	int wait_for_ack
+);
+
+
 int xmodem_fini(
 	xmodem_block_t * const block
 );
 
 
+void
+xmodem_cancel(void);
+
+
 #endif